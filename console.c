@@ -13,12 +13,21 @@
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "perf.h"
 #include "report.h"
 
+/* Only for the allocation totals reported with the metrics */
+#define INTERNAL 1
+#include "harness.h"
+
 /* Some global values */
 int simulation = 0;
+static int perf_mode = 0;
+static int async_log = 0;
+static int cmd_depth = 0;
 static cmd_ptr cmd_list = NULL;
 static param_ptr param_list = NULL;
 static bool block_flag = false;
@@ -76,6 +85,97 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/*
+ * Commands and parameters are also indexed by name in open-addressing hash
+ * tables, so that looking one up does not walk the alphabetical lists.
+ */
+typedef struct {
+    uint32_t hash;
+    void *ele; /* cmd_ptr or param_ptr, both starting with the name */
+} name_slot_t;
+
+typedef struct {
+    name_slot_t *slots;
+    size_t size; /* Power of 2, or 0 when empty */
+    size_t count;
+} name_table_t;
+
+#define NAME_TABLE_MIN 64
+
+static name_table_t cmd_table;
+static name_table_t param_table;
+
+/* FNV-1a */
+static uint32_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline const char *slot_name(const name_slot_t *slot)
+{
+    return *(char **) slot->ele;
+}
+
+/* Find the slot holding name, or the empty slot where it belongs */
+static name_slot_t *table_probe(const name_table_t *t,
+                                const char *name,
+                                uint32_t h)
+{
+    size_t mask = t->size - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        name_slot_t *slot = &t->slots[i];
+        if (!slot->ele ||
+            (slot->hash == h && strcmp(slot_name(slot), name) == 0))
+            return slot;
+    }
+}
+
+static void *table_find(const name_table_t *t, const char *name)
+{
+    if (!t->size)
+        return NULL;
+    return table_probe(t, name, name_hash(name))->ele;
+}
+
+static void table_insert(name_table_t *t, void *ele)
+{
+    /* Keep the table at most half full */
+    if (2 * (t->count + 1) > t->size) {
+        name_table_t old = *t;
+        t->size = old.size ? 2 * old.size : NAME_TABLE_MIN;
+        t->slots = calloc_or_fail(t->size, sizeof(name_slot_t), "table_insert");
+        for (size_t i = 0; i < old.size; i++) {
+            name_slot_t *slot = &old.slots[i];
+            if (slot->ele)
+                *table_probe(t, slot_name(slot), slot->hash) = *slot;
+        }
+        if (old.slots)
+            free_array(old.slots, old.size, sizeof(name_slot_t));
+    }
+
+    const char *name = *(char **) ele;
+    uint32_t h = name_hash(name);
+    name_slot_t *slot = table_probe(t, name, h);
+    if (!slot->ele)
+        t->count++;
+    /* A later definition takes over the name, as with the lists */
+    slot->hash = h;
+    slot->ele = ele;
+}
+
+static void table_free(name_table_t *t)
+{
+    if (t->slots)
+        free_array(t->slots, t->size, sizeof(name_slot_t));
+    t->slots = NULL;
+    t->size = t->count = 0;
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_function operation, char *documentation)
 {
@@ -92,6 +192,7 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->documentation = documentation;
     ele->next = next_cmd;
     *last_loc = ele;
+    table_insert(&cmd_table, ele);
 }
 
 /* Add a new parameter */
@@ -114,6 +215,7 @@ void add_param(char *name,
     ele->setter = setter;
     ele->next = next_param;
     *last_loc = ele;
+    table_insert(&param_table, ele);
 }
 
 /* Parse a string into a command line */
@@ -177,12 +279,50 @@ static bool interpret_cmda(int argc, char *argv[])
     if (argc == 0)
         return true;
     /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
+    cmd_ptr next_cmd = table_find(&cmd_table, argv[0]);
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
+        /* Only the outermost command is measured, e.g., a whole "time" */
+        bool top = !cmd_depth;
+        struct timespec start;
+        alloc_totals_t before;
+        if (top) {
+            alloc_totals(&before);
+            reset_peak_bytes();
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        bool counting = perf_mode && top;
+        if (counting && !perf_start()) {
+            report(1, "Performance counters are not available");
+            perf_mode = 0;
+            counting = false;
+        }
+        cmd_depth++;
         ok = next_cmd->operation(argc, argv);
+        cmd_depth--;
+        if (counting) {
+            perf_sample_t sample;
+            perf_stop(&sample);
+            if (perf_mode)
+                perf_report(&sample);
+        }
+        if (top) {
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            alloc_totals_t after;
+            alloc_totals(&after);
+            cmd_metrics_t m = {
+                .argc = argc,
+                .argv = argv,
+                .duration_ns = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+                               end.tv_nsec - start.tv_nsec,
+                .allocs = after.allocs - before.allocs,
+                .bytes = after.bytes - before.bytes,
+                .peak_bytes = after.peak_bytes,
+                .ok = ok,
+            };
+            report_metrics(&m);
+        }
         if (!ok)
             record_error();
     } else {
@@ -246,6 +386,9 @@ static bool do_quit(int argc, char *argv[])
         free_block(ele, sizeof(param_ele));
     }
 
+    table_free(&cmd_table);
+    table_free(&param_table);
+
     while (buf_stack)
         pop_file();
 
@@ -317,7 +460,6 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -326,23 +468,16 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_ptr plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
-        /* Didn't find parameter */
-        if (!found) {
+        /* Find parameter */
+        param_ptr plist = table_find(&param_table, name);
+        if (!plist) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        int oldval = *plist->valp;
+        *plist->valp = value;
+        if (plist->setter)
+            plist->setter(oldval);
     }
 
     return true;
@@ -397,11 +532,19 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+static void async_log_setter(int oldval)
+{
+    if (!set_async_log(async_log != 0))
+        async_log = oldval;
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    table_free(&cmd_table);
+    table_free(&param_table);
     err_cnt = 0;
     quit_flag = false;
 
@@ -416,6 +559,10 @@ void init_cmd()
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
+    add_param("perf", &perf_mode,
+              "Report hardware performance counters of each command", NULL);
+    add_param("asynclog", &async_log,
+              "Write reports from a background thread", async_log_setter);
 
     init_in();
     init_time(&last_time);
@@ -556,6 +703,7 @@ int cmd_select(int nfds,
         infd = buf_stack->fd;
         FD_SET(infd, readfds);
         if (infd == STDIN_FILENO && prompt_flag) {
+            report_flush();
             printf("%s", prompt);
             fflush(stdout);
             prompt_flag = true;
@@ -645,11 +793,13 @@ bool run_console(char *infile_name)
 
     if (!has_infile) {
         char *cmdline;
+        report_flush();
         while ((cmdline = linenoise(prompt)) != NULL) {
             interpret_cmd(cmdline);
             linenoiseHistoryAdd(cmdline);       /* Add to the history. */
             linenoiseHistorySave(HISTORY_FILE); /* Save the history on disk. */
             linenoiseFree(cmdline);
+            report_flush();
         }
     } else {
         while (!cmd_done())
@@ -1,10 +1,17 @@
 /* Test support code */
 
+#define _GNU_SOURCE /* dladdr */
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "report.h"
@@ -24,9 +31,21 @@
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
+/* Value at start of every block allocated in guard mode, which has no footer */
+#define MAGICGUARD 0xdeadfeed
+
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
+/* Bytes filled at each end of a block that is not poisoned in full */
+#define POISON_EDGE 64
+
+/* Alignment of payloads, matching what malloc guarantees */
+#define PAYLOAD_ALIGN 16
+
+/* Number of freed guard-mode blocks kept inaccessible before unmapping */
+#define QUARANTINE_SIZE 1024
+
 /* Data structures used by our code */
 
 /*
@@ -36,76 +55,412 @@
 typedef struct BELE {
     struct BELE *next, *prev;
     size_t payload_size;
+    void *site;          /* Return address of the call that allocated it */
     size_t magic_header; /* Marker to see if block seems legitimate */
-    unsigned char payload[0];
+    unsigned char payload[0] __attribute__((aligned(PAYLOAD_ALIGN)));
     /* Also place magic number at tail of every block */
 } block_ele_t;
 
-static block_ele_t *allocated = NULL;
+/* Allocation counts of one call site */
+typedef struct {
+    void *site;
+    size_t live_count, live_bytes;
+    size_t total_count, total_bytes;
+} site_stat_t;
+
+/* Number of call sites tracked per shard, a power of 2 */
+#define MAX_SITES 64
+
+/*
+ * Allocated blocks are spread over shards by address, each with its own
+ * lock, so that queue operations running on several threads, e.g., parallel
+ * sort, rarely contend. A block can be freed by any thread, since its shard
+ * follows from its address alone.
+ *
+ * Every shard keeps its blocks in a list, and in an open-addressing hash set
+ * so that cautious mode checks a block in O(1) instead of scanning the list.
+ * Collisions are resolved by linear probing, and removal shifts the rest of
+ * the probe sequence back, so there are no tombstones.
+ */
+#define SHARD_BITS 4
+#define MIN_TABLE_SIZE 64
+
+typedef struct {
+    pthread_mutex_t lock;
+    block_ele_t *allocated;
+    size_t count;
+    block_ele_t **table;
+    size_t table_size; /* Always a power of 2 once allocated */
+    /* Hash table of the call sites that allocated from this shard */
+    site_stat_t sites[MAX_SITES];
+    site_stat_t other_sites; /* Whatever does not fit in the table */
+} shard_t;
+
+static shard_t shards[1 << SHARD_BITS] = {
+    [0 ...(1 << SHARD_BITS) - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+/* Total over all shards, kept apart so that it can be read without locks */
 static size_t allocated_count = 0;
 
+/* Allocations and bytes ever handed out, and the peak of live bytes */
+static size_t total_allocs = 0;
+static size_t total_bytes = 0;
+static size_t live_bytes = 0;
+static size_t peak_bytes = 0;
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/*
+ * Deterministic fault injection. Allocations are numbered from 1 since the
+ * schedule was last reset, and each nonzero setting selects some to fail.
+ */
+int fail_nth = 0;   /* Fail this allocation only */
+int fail_every = 0; /* Fail every allocation whose number is a multiple */
+int fail_size = 0;  /* Fail requests in the power-of-2 size class of this */
+int fail_seed = 0;  /* Draw the fail_probability failures from this seed */
+static uint64_t alloc_seq = 0;
+
+/* Place every block right in front of an inaccessible page */
+int guard_mode = 0;
+
+/* Mappings of freed guard-mode blocks, kept inaccessible to catch use after
+ * free */
+static struct {
+    void *base;
+    size_t len;
+} quarantine[QUARANTINE_SIZE];
+static size_t quarantine_next = 0;
+
+/* Percent of blocks whose whole payload is filled with FILLCHAR */
+int poison_rate = 100;
+static uint64_t poison_count = 0;
+
+/* Guards the quarantine, which all shards share */
+static pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
+/* Set by any thread, and read and cleared with atomic operations */
 static bool error_occurred = false;
-static char *error_message = "";
+static __thread char *error_message = "";
 
-static int time_limit = 1;
+/* Time budget of a risky operation in milliseconds, or 0 for none */
+int time_limit = 1000;
+/* Count the budget in CPU time of the process rather than wall-clock time */
+int time_limit_cpu = 0;
 
 /*
- * Data for managing exceptions
+ * One timer per kind of budget, both raising SIGALRM when they expire.
+ * They are created on first use.
  */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
+static timer_t limit_timers[2];
+static bool limit_timers_ok;
+static pthread_once_t limit_timers_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Data for managing exceptions.
+ * The jump target is only valid on the thread that set it up, so it is kept
+ * per thread and other threads never jump to it. The timers are shared by
+ * the whole process, and so is the state of the armed budget.
+ */
+static __thread sigjmp_buf env;
+static __thread volatile sig_atomic_t jmp_ready = false;
 static bool time_limited = false;
+static int limit_clock; /* Index of the armed timer */
+
+/*
+ * Sections holding a lock that an exception must not jump out of, and
+ * whether an exception was raised in one of them and is waiting for it to
+ * end.
+ */
+static __thread volatile sig_atomic_t exception_holds = 0;
+static __thread volatile sig_atomic_t exception_pending = false;
 
 /*
  * Internal functions
  */
 
-/* Should this allocation fail? */
-static bool fail_allocation()
+static void raise_exception();
+
+static inline void shard_lock(shard_t *sh)
+{
+    exception_hold();
+    pthread_mutex_lock(&sh->lock);
+}
+
+static inline void shard_unlock(shard_t *sh)
+{
+    pthread_mutex_unlock(&sh->lock);
+    exception_release();
+}
+
+/* Scramble the bits of x (the splitmix64 finalizer) */
+static inline uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* Number of bits needed to represent size */
+static inline int size_class(size_t size)
+{
+    return size ? 64 - __builtin_clzll(size) : 0;
+}
+
+/* Should this allocation of size bytes fail? */
+static bool fail_allocation(size_t size)
+{
+    uint64_t n = __atomic_add_fetch(&alloc_seq, 1, __ATOMIC_RELAXED);
+    if (fail_nth > 0 && n == (uint64_t) fail_nth)
+        return true;
+    if (fail_every > 0 && n % fail_every == 0)
+        return true;
+    if (fail_size > 0 && size_class(size) == size_class(fail_size))
+        return true;
+
+    if (fail_probability <= 0)
+        return false;
+    /* A given seed fails the same allocations on every run */
+    uint64_t draw = fail_seed ? mix64(n ^ mix64(fail_seed)) : random();
+    return draw % 100 < (uint64_t) fail_probability;
+}
+
+static inline uint64_t address_hash(const block_ele_t *b)
+{
+    uint64_t x = (uintptr_t) b;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* The top bits of the hash pick the shard, the bottom ones the slot */
+static inline shard_t *shard_of(const block_ele_t *b)
+{
+    return &shards[address_hash(b) >> (64 - SHARD_BITS)];
+}
+
+static inline size_t block_hash(const shard_t *sh, const block_ele_t *b)
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    return address_hash(b) & (sh->table_size - 1);
+}
+
+/* Return the slot holding block b, or the empty slot ending its probe */
+static size_t table_slot(const shard_t *sh, const block_ele_t *b)
+{
+    size_t i = block_hash(sh, b);
+    while (sh->table[i] && sh->table[i] != b)
+        i = (i + 1) & (sh->table_size - 1);
+    return i;
+}
+
+/* Rebuild the table of shard sh with room for size entries */
+static bool table_resize(shard_t *sh, size_t size)
+{
+    block_ele_t **old = sh->table;
+    size_t old_size = sh->table_size;
+
+    sh->table = calloc(size, sizeof(block_ele_t *));
+    if (!sh->table) {
+        sh->table = old;
+        return false;
+    }
+    sh->table_size = size;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i])
+            sh->table[table_slot(sh, old[i])] = old[i];
+    }
+    free(old);
+    return true;
+}
+
+/* Add block b to the table, keeping the load factor at most 1/2 */
+static bool table_insert(shard_t *sh, block_ele_t *b)
+{
+    if (2 * (sh->count + 1) > sh->table_size &&
+        !table_resize(sh, sh->table_size ? 2 * sh->table_size
+                                         : MIN_TABLE_SIZE))
+        return false;
+    sh->table[table_slot(sh, b)] = b;
+    return true;
+}
+
+static bool table_contains(const shard_t *sh, const block_ele_t *b)
+{
+    return sh->table_size && sh->table[table_slot(sh, b)] == b;
+}
+
+/* Remove block b from the table, if present */
+static void table_remove(shard_t *sh, const block_ele_t *b)
+{
+    if (!sh->table_size)
+        return;
+
+    size_t mask = sh->table_size - 1;
+    size_t i = table_slot(sh, b);
+    if (!sh->table[i])
+        return;
+
+    /* Move back every later entry whose probe sequence passes through i */
+    for (size_t j = (i + 1) & mask; sh->table[j]; j = (j + 1) & mask) {
+        size_t k = block_hash(sh, sh->table[j]);
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            sh->table[i] = sh->table[j];
+            i = j;
+        }
+    }
+    sh->table[i] = NULL;
+}
+
+/* Return the statistics of call site in shard sh, adding it if needed */
+static site_stat_t *site_stat(shard_t *sh, void *site)
+{
+    size_t i = ((uintptr_t) site >> 2) * 0x9e3779b97f4a7c15ULL >> 58;
+    for (size_t n = 0; n < MAX_SITES; n++, i = (i + 1) & (MAX_SITES - 1)) {
+        if (sh->sites[i].site == site)
+            return &sh->sites[i];
+        if (!sh->sites[i].site) {
+            sh->sites[i].site = site;
+            return &sh->sites[i];
+        }
+    }
+    return &sh->other_sites;
+}
+
+static inline void set_error()
+{
+    __atomic_store_n(&error_occurred, true, __ATOMIC_RELAXED);
 }
 
 /*
- * Find header of block, given its payload.
+ * Fill the payload at p with FILLCHAR.
+ * Only a sample of poison_rate percent of the blocks is filled in full; the
+ * others get just their first and last POISON_EDGE bytes, which is where
+ * overruns and stale reads usually land.
+ */
+static void poison(unsigned char *p, size_t size)
+{
+    if (poison_rate < 100 && size > 2 * POISON_EDGE) {
+        /* Scramble a shared counter, so that concurrent callers are safe */
+        uint64_t x = __atomic_fetch_add(&poison_count, 1, __ATOMIC_RELAXED);
+        if (mix64(x) % 100 >= (uint64_t) poison_rate) {
+            memset(p, FILLCHAR, POISON_EDGE);
+            memset(p + size - POISON_EDGE, FILLCHAR, POISON_EDGE);
+            return;
+        }
+    }
+    memset(p, FILLCHAR, size);
+}
+
+/*
+ * Return the size of the accessible pages in front of the guard page of a
+ * guard-mode block with a payload of the given size.
+ */
+static size_t guard_data_size(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t need = sizeof(block_ele_t) + size + PAYLOAD_ALIGN - 1;
+    return (need + page - 1) & ~(page - 1);
+}
+
+/*
+ * Map a block so that its payload ends right at a PROT_NONE page, apart from
+ * fewer than PAYLOAD_ALIGN bytes of slack, which are filled with FILLCHAR.
+ * An overrun then faults at the offending access.
+ * Return NULL if the mapping could not be set up.
+ */
+static block_ele_t *guard_alloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t data = guard_data_size(size);
+    unsigned char *base = mmap(NULL, data + page, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    unsigned char *guard = base + data;
+    if (mprotect(guard, page, PROT_NONE)) {
+        munmap(base, data + page);
+        return NULL;
+    }
+
+    unsigned char *payload =
+        (unsigned char *) ((uintptr_t) (guard - size) & ~(PAYLOAD_ALIGN - 1));
+    memset(payload + size, FILLCHAR, guard - payload - size);
+    return (block_ele_t *) (payload - sizeof(block_ele_t));
+}
+
+/* Check that the slack between payload and guard page was not written */
+static bool guard_intact(block_ele_t *b)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    unsigned char *end = b->payload + b->payload_size;
+    unsigned char *guard =
+        (unsigned char *) (((uintptr_t) end + page - 1) & ~(page - 1));
+    for (; end < guard; end++) {
+        if (*end != FILLCHAR)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Make the freed guard-mode block b inaccessible, so that later uses fault,
+ * and unmap the oldest block in quarantine to make room for it.
+ */
+static void guard_release(block_ele_t *b)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t data = guard_data_size(b->payload_size);
+    uintptr_t guard =
+        ((uintptr_t) b->payload + b->payload_size + page - 1) & ~(page - 1);
+    void *base = (void *) (guard - data);
+    mprotect(base, data, PROT_NONE);
+
+    exception_hold();
+    pthread_mutex_lock(&quarantine_lock);
+    if (quarantine[quarantine_next].base)
+        munmap(quarantine[quarantine_next].base,
+               quarantine[quarantine_next].len);
+    quarantine[quarantine_next].base = base;
+    quarantine[quarantine_next].len = data + page;
+    quarantine_next = (quarantine_next + 1) % QUARANTINE_SIZE;
+    pthread_mutex_unlock(&quarantine_lock);
+    exception_release();
+}
+
+/*
+ * Find header of block, given its payload, which belongs to shard sh.
  * Signal error if doesn't seem like legitimate block
  */
-static block_ele_t *find_header(void *p)
+static block_ele_t *find_header(shard_t *sh, void *p)
 {
     if (!p) {
         report_event(MSG_ERROR, "Attempting to free null block");
-        error_occurred = true;
+        set_error();
     }
 
     block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!table_contains(sh, b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
-            error_occurred = true;
+            set_error();
+            /* Its header may not even be readable, e.g., in quarantine */
+            return NULL;
         }
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    if (b->magic_header != MAGICHEADER && b->magic_header != MAGICGUARD) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
             p);
-        error_occurred = true;
+        set_error();
     }
 
     return b;
@@ -120,47 +475,84 @@ static size_t *find_footer(block_ele_t *b)
 }
 
 /*
- * Implementation of application functions
+ * Allocate a block of size bytes on behalf of the caller at site.
  */
-void *test_malloc(size_t size)
+static void *alloc_block(size_t size, void *site)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to malloc disallowed");
         return NULL;
     }
 
-    if (fail_allocation()) {
+    if (fail_allocation(size)) {
         report_event(MSG_WARN, "Malloc returning NULL");
         return NULL;
     }
 
-    block_ele_t *new_block =
-        malloc(size + sizeof(block_ele_t) + sizeof(size_t));
-    if (!new_block) {
-        report_event(MSG_FATAL, "Couldn't allocate any more memory");
-        error_occurred = true;
-    }
+    /* Fall back to a regular block once the kernel runs out of mappings */
+    block_ele_t *new_block = guard_mode ? guard_alloc(size) : NULL;
+    if (new_block) {
+        new_block->magic_header = MAGICGUARD;
+        new_block->payload_size = size;
+    } else {
+        new_block = malloc(size + sizeof(block_ele_t) + sizeof(size_t));
+        if (!new_block) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            set_error();
+        }
 
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
+        // cppcheck-suppress nullPointerRedundantCheck
+        new_block->magic_header = MAGICHEADER;
+        // cppcheck-suppress nullPointerRedundantCheck
+        new_block->payload_size = size;
+        *find_footer(new_block) = MAGICFOOTER;
+    }
     void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
+    poison(p, size);
+    shard_t *sh = shard_of(new_block);
+    shard_lock(sh);
+    if (!table_insert(sh, new_block)) {
+        shard_unlock(sh);
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        set_error();
+    }
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
+    new_block->next = sh->allocated;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->prev = NULL;
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    if (sh->allocated)
+        sh->allocated->prev = new_block;
+    sh->allocated = new_block;
+    sh->count++;
+    new_block->site = site;
+    site_stat_t *st = site_stat(sh, site);
+    st->live_count++;
+    st->live_bytes += size;
+    st->total_count++;
+    st->total_bytes += size;
+    shard_unlock(sh);
+    __atomic_add_fetch(&allocated_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&total_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&total_bytes, size, __ATOMIC_RELAXED);
+    size_t live = __atomic_add_fetch(&live_bytes, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&peak_bytes, &peak, live, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
 
     return p;
 }
 
+/*
+ * Implementation of application functions
+ */
+void *test_malloc(size_t size)
+{
+    return alloc_block(size, __builtin_return_address(0));
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
@@ -168,7 +560,7 @@ void *test_calloc(size_t nelem, size_t elsize)
      * https://danluu.com/malloc-tutorial/
      */
     size_t size = nelem * elsize;  // TODO: check for overflow
-    void *ptr = test_malloc(size);
+    void *ptr = alloc_block(size, __builtin_return_address(0));
     memset(ptr, 0, size);
     return ptr;
 }
@@ -183,38 +575,58 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_ele_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
+    shard_t *sh = shard_of((block_ele_t *) p - 1);
+    shard_lock(sh);
+    block_ele_t *b = find_header(sh, p);
+    if (!b) {
+        shard_unlock(sh);
+        return;
+    }
+
+    /* Overruns of a guard-mode block fault right away, except in its slack */
+    bool guarded = b->magic_header == MAGICGUARD;
+    if (guarded ? !guard_intact(b) : *find_footer(b) != MAGICFOOTER) {
         report_event(MSG_ERROR,
                      "Corruption detected in block with address %p when "
                      "attempting to free it",
                      p);
-        error_occurred = true;
+        set_error();
     }
     b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
+    if (!guarded) {
+        *find_footer(b) = MAGICFREE;
+        poison(p, b->payload_size);
+    }
 
     /* Unlink from list */
+    table_remove(sh, b);
     block_ele_t *bn = b->next;
     block_ele_t *bp = b->prev;
     if (bp)
         bp->next = bn;
     else
-        allocated = bn;
+        sh->allocated = bn;
     if (bn)
         bn->prev = bp;
-
-    free(b);
-    allocated_count--;
+    sh->count--;
+    site_stat_t *st = site_stat(sh, b->site);
+    st->live_count--;
+    st->live_bytes -= b->payload_size;
+    shard_unlock(sh);
+    __atomic_sub_fetch(&allocated_count, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&live_bytes, b->payload_size, __ATOMIC_RELAXED);
+
+    if (guarded)
+        guard_release(b);
+    else
+        free(b);
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc_block(len, __builtin_return_address(0));
     if (!new)
         return NULL;
 
@@ -223,13 +635,135 @@ char *test_strdup(const char *s)
 
 size_t allocation_check()
 {
-    return allocated_count;
+    return __atomic_load_n(&allocated_count, __ATOMIC_RELAXED);
+}
+
+void alloc_totals(alloc_totals_t *t)
+{
+    t->allocs = __atomic_load_n(&total_allocs, __ATOMIC_RELAXED);
+    t->bytes = __atomic_load_n(&total_bytes, __ATOMIC_RELAXED);
+    t->peak_bytes = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+}
+
+void reset_peak_bytes()
+{
+    __atomic_store_n(&peak_bytes, __atomic_load_n(&live_bytes, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+void mem_stat(mem_stat_t *ms)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    memset(ms, 0, sizeof(*ms));
+    for (int i = 0; i < 1 << SHARD_BITS; i++) {
+        shard_t *sh = &shards[i];
+        shard_lock(sh);
+        for (block_ele_t *b = sh->allocated; b; b = b->next) {
+            size_t size = b->payload_size;
+            ms->blocks++;
+            ms->payload_bytes += size;
+            ms->size_hist[size_class(size)]++;
+            if (b->magic_header == MAGICGUARD) {
+                ms->overhead_bytes += sizeof(block_ele_t);
+                ms->footprint_bytes += guard_data_size(size) + page;
+            } else {
+                ms->overhead_bytes += sizeof(block_ele_t) + sizeof(size_t);
+                ms->footprint_bytes += malloc_usable_size(b);
+            }
+        }
+        shard_unlock(sh);
+    }
+}
+
+/* Describe call site as symbol+offset, or module+offset without a symbol */
+static void site_name(void *site, char *buf, size_t len)
+{
+    Dl_info info;
+    if (!site || !dladdr(site, &info)) {
+        snprintf(buf, len, "%p", site);
+    } else if (info.dli_sname) {
+        snprintf(buf, len, "%s+0x%lx", info.dli_sname,
+                 (unsigned long) ((char *) site - (char *) info.dli_saddr));
+    } else {
+        const char *module = strrchr(info.dli_fname, '/');
+        snprintf(buf, len, "%s+0x%lx", module ? module + 1 : info.dli_fname,
+                 (unsigned long) ((char *) site - (char *) info.dli_fbase));
+    }
+}
+
+static bool sort_by_live;
+
+static int site_cmp(const void *a, const void *b)
+{
+    const site_stat_t *x = a, *y = b;
+    size_t vx = sort_by_live ? x->live_bytes : x->total_bytes;
+    size_t vy = sort_by_live ? y->live_bytes : y->total_bytes;
+    return vx < vy ? 1 : vx > vy ? -1 : 0;
+}
+
+void report_alloc_sites(bool live_only)
+{
+    /* Merge the statistics of every call site over all shards */
+    size_t max = (MAX_SITES + 1) << SHARD_BITS, n = 0;
+    site_stat_t *all = calloc(max, sizeof(site_stat_t));
+    if (!all) {
+        report(1, "Not enough memory to collect allocation sites");
+        return;
+    }
+    for (int i = 0; i < 1 << SHARD_BITS; i++) {
+        shard_t *sh = &shards[i];
+        shard_lock(sh);
+        for (int j = 0; j <= MAX_SITES; j++) {
+            site_stat_t *st = j < MAX_SITES ? &sh->sites[j] : &sh->other_sites;
+            if (!st->total_count)
+                continue;
+            size_t k = 0;
+            while (k < n && all[k].site != st->site)
+                k++;
+            if (k == n)
+                all[n++].site = st->site;
+            all[k].live_count += st->live_count;
+            all[k].live_bytes += st->live_bytes;
+            all[k].total_count += st->total_count;
+            all[k].total_bytes += st->total_bytes;
+        }
+        shard_unlock(sh);
+    }
+
+    sort_by_live = live_only;
+    qsort(all, n, sizeof(site_stat_t), site_cmp);
+
+    if (!live_only)
+        report(1, "%10s %12s %10s %12s  %s", "live", "live bytes", "total",
+               "total bytes", "call site");
+    for (size_t k = 0; k < n; k++) {
+        if (live_only && !all[k].live_count)
+            continue;
+        char name[128];
+        site_name(all[k].site, name, sizeof(name));
+        if (live_only)
+            report(1, "  %lu blocks (%lu bytes) allocated from %s",
+                   all[k].live_count, all[k].live_bytes, name);
+        else
+            report(1, "%10lu %12lu %10lu %12lu  %s", all[k].live_count,
+                   all[k].live_bytes, all[k].total_count, all[k].total_bytes,
+                   name);
+    }
+    free(all);
 }
 
 /*
  * Implementation of functions for testing
  */
 
+/*
+ * Restart the numbering of allocations used by deterministic fault injection.
+ */
+void reset_fault_schedule()
+{
+    __atomic_store_n(&alloc_seq, 0, __ATOMIC_RELAXED);
+}
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -253,63 +787,118 @@ void set_noallocate_mode(bool noallocate)
  */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return __atomic_exchange_n(&error_occurred, false, __ATOMIC_RELAXED);
 }
 
-/*
- * Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
- */
-bool exception_setup(bool limit_time)
-{
-    if (sigsetjmp(env, 1)) {
-        /* Got here from longjmp */
-        jmp_ready = false;
-        if (time_limited) {
-            alarm(0);
-            time_limited = false;
-        }
-
-        if (error_message)
-            report_event(MSG_ERROR, error_message);
-        error_message = "";
-        return false;
+static void create_limit_timers()
+{
+    clockid_t clocks[2] = {CLOCK_MONOTONIC, CLOCK_PROCESS_CPUTIME_ID};
+    struct sigevent sev = {
+        .sigev_notify = SIGEV_SIGNAL,
+        .sigev_signo = SIGALRM,
+    };
+    limit_timers_ok = true;
+    for (int i = 0; i < 2; i++) {
+        if (timer_create(clocks[i], &sev, &limit_timers[i]))
+            limit_timers_ok = false;
     }
+    if (!limit_timers_ok)
+        report_event(MSG_WARN, "Cannot create timers, time limit disabled");
+}
+
+/* Start the time budget, unless it is unlimited */
+static void arm_time_limit()
+{
+    pthread_once(&limit_timers_once, create_limit_timers);
+    if (!limit_timers_ok || time_limit <= 0)
+        return;
+
+    struct itimerspec its = {
+        .it_value.tv_sec = time_limit / 1000,
+        .it_value.tv_nsec = (time_limit % 1000) * 1000000L,
+    };
+    limit_clock = time_limit_cpu ? 1 : 0;
+    timer_settime(limit_timers[limit_clock], 0, &its, NULL);
+    time_limited = true;
+}
+
+static void disarm_time_limit()
+{
+    if (!time_limited)
+        return;
+
+    struct itimerspec its = {0};
+    timer_settime(limit_timers[limit_clock], 0, &its, NULL);
+    time_limited = false;
+}
+
+sigjmp_buf *exception_env()
+{
+    return &env;
+}
 
-    /* Got here from initial call */
+/* Initial return of exception_setup */
+bool exception_armed(bool limit_time)
+{
     jmp_ready = true;
-    if (limit_time) {
-        alarm(time_limit);
-        time_limited = true;
-    }
+    if (limit_time)
+        arm_time_limit();
     return true;
 }
 
+/* Return of exception_setup through an exception */
+bool exception_caught()
+{
+    jmp_ready = false;
+    disarm_time_limit();
+
+    if (error_message)
+        report_event(MSG_ERROR, error_message);
+    error_message = "";
+    return false;
+}
+
 /*
  * Call once past risky code
  */
 void exception_cancel()
 {
-    if (time_limited) {
-        alarm(0);
-        time_limited = false;
-    }
+    disarm_time_limit();
 
     jmp_ready = false;
     error_message = "";
 }
 
+void exception_hold()
+{
+    exception_holds++;
+}
+
+void exception_release()
+{
+    if (--exception_holds == 0 && exception_pending) {
+        exception_pending = false;
+        raise_exception();
+    }
+}
+
+static void raise_exception()
+{
+    if (jmp_ready)
+        siglongjmp(env, 1);
+    else
+        exit(1);
+}
+
 /*
  * Use longjmp to return to most recent exception setup
  */
 void trigger_exception(char *msg)
 {
-    error_occurred = true;
+    set_error();
     error_message = msg;
-    if (jmp_ready)
-        siglongjmp(env, 1);
+    if (exception_holds)
+        exception_pending = true;
     else
-        exit(1);
+        raise_exception();
 }
@@ -4,6 +4,7 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 /*
  * This test harness enables us to do stringent testing of code.
@@ -19,12 +20,69 @@ char *test_strdup(const char *s);
 
 #ifdef INTERNAL
 
-/* Report number of allocated blocks */
+/* Report number of allocated blocks, summed over all threads */
 size_t allocation_check();
 
+/* Running allocation totals */
+typedef struct {
+    size_t allocs;     /* Blocks allocated so far */
+    size_t bytes;      /* Payload bytes allocated so far */
+    size_t peak_bytes; /* Most payload bytes live since reset_peak_bytes() */
+} alloc_totals_t;
+
+void alloc_totals(alloc_totals_t *t);
+void reset_peak_bytes();
+
+/* Memory taken by the blocks currently allocated */
+typedef struct {
+    size_t blocks;
+    size_t payload_bytes;   /* As requested by the callers */
+    size_t overhead_bytes;  /* Block headers and footers added by the harness */
+    size_t footprint_bytes; /* As reserved underneath, slack included */
+    /* Blocks by payload size: entry k counts sizes in [2^(k-1), 2^k) */
+    size_t size_hist[65];
+} mem_stat_t;
+
+/* Collect memory statistics over all live blocks */
+void mem_stat(mem_stat_t *ms);
+
+/*
+ * Report allocation counts and bytes per call site, live and cumulative,
+ * in order of decreasing volume.
+ * With live_only, report just where the blocks still allocated came from.
+ */
+void report_alloc_sites(bool live_only);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/*
+ * Deterministic fault injection.
+ * Allocations are numbered from 1 since the last reset_fault_schedule().
+ * fail_nth fails that allocation only, fail_every fails every allocation
+ * whose number is a multiple of it, and fail_size fails every request in the
+ * same power-of-2 size class. With a nonzero fail_seed, the failures due to
+ * fail_probability are derived from the seed and the allocation number, so
+ * that they can be replayed. Zero disables each setting.
+ */
+extern int fail_nth;
+extern int fail_every;
+extern int fail_size;
+extern int fail_seed;
+void reset_fault_schedule();
+
+/*
+ * Percent of blocks filled with a fill pattern in full when allocated and
+ * freed. The rest only get their first and last 64 bytes filled.
+ */
+extern int poison_rate;
+
+/*
+ * Place every new block right in front of an inaccessible page, so that an
+ * overrun faults immediately. Freed blocks stay inaccessible for a while.
+ */
+extern int guard_mode;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -42,11 +100,31 @@ void set_noallocate_mode(bool noallocate);
  */
 bool error_check();
 
+/*
+ * Time budget of each risky operation in milliseconds, or 0 for none.
+ * It is counted in wall-clock time, or in CPU time of the process when
+ * time_limit_cpu is set. Going over it raises SIGALRM.
+ */
+extern int time_limit;
+extern int time_limit_cpu;
+
+/* Helpers of exception_setup */
+sigjmp_buf *exception_env();
+bool exception_armed(bool limit_time);
+bool exception_caught();
+
 /*
  * Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
+ * Evaluates to true for initial return, false for error return
+ * Only the thread that set up the context can return to it: on any other
+ * thread, trigger_exception ends the process. The time limit uses timers of
+ * the whole process, so only one thread at a time may run time-limited code.
+ * This is a macro so that sigsetjmp runs in the frame of the caller, which
+ * is still live when an exception jumps back to it.
  */
-bool exception_setup(bool limit_time);
+#define exception_setup(limit_time)                                 \
+    (sigsetjmp(*exception_env(), 1) == 0 ? exception_armed(limit_time) \
+                                         : exception_caught())
 
 /*
  * Call once past risky code
@@ -55,9 +133,18 @@ void exception_cancel();
 
 /*
  * Use longjmp to return to most recent exception setup.  Include error message
+ * Inside a section bracketed by exception_hold and exception_release, the
+ * jump is deferred to the end of the section.
  */
 void trigger_exception(char *msg);
 
+/*
+ * Bracket a section holding a lock, which an exception must not leave with
+ * the lock still held. Sections may nest.
+ */
+void exception_hold();
+void exception_release();
+
 #else /* !INTERNAL */
 
 /* Tested program use our versions of malloc and free */
@@ -0,0 +1,65 @@
+/* Latency histograms with percentile queries */
+
+#include "latency.h"
+
+#include <string.h>
+
+#define SUB_COUNT (1 << LAT_SUB_BITS)
+
+static inline int bucket_of(uint64_t value)
+{
+    if (value < SUB_COUNT)
+        return value;
+    int e = 63 - __builtin_clzll(value);
+    int sub = (value >> (e - LAT_SUB_BITS)) & (SUB_COUNT - 1);
+    return ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + sub;
+}
+
+/* Largest value that falls in bucket b */
+static inline uint64_t bucket_end(int b)
+{
+    if (b < SUB_COUNT)
+        return b;
+    int e = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    uint64_t low = (uint64_t) (SUB_COUNT + (b & (SUB_COUNT - 1)))
+                   << (e - LAT_SUB_BITS);
+    return low + ((uint64_t) 1 << (e - LAT_SUB_BITS)) - 1;
+}
+
+void lat_record(lat_hist_t *h, uint64_t value)
+{
+    h->count[bucket_of(value)]++;
+    h->total++;
+    if (value > h->max)
+        h->max = value;
+}
+
+uint64_t lat_percentile(const lat_hist_t *h, double q)
+{
+    if (!h->total)
+        return 0;
+
+    /* Rank of the value sought, counting from 1 */
+    uint64_t rank = (uint64_t) (q * h->total);
+    if (rank < q * h->total)
+        rank++;
+    if (rank < 1)
+        rank = 1;
+    if (rank > h->total)
+        rank = h->total;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen >= rank) {
+            uint64_t end = bucket_end(b);
+            return end < h->max ? end : h->max;
+        }
+    }
+    return h->max;
+}
+
+void lat_reset(lat_hist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
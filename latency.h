@@ -0,0 +1,41 @@
+#ifndef LAB0_LATENCY_H
+#define LAB0_LATENCY_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Log-bucketed latency histogram in the style of HdrHistogram: every power
+ * of 2 is split into 2^LAT_SUB_BITS linear sub-buckets, so that a recorded
+ * value is known to within about 6% over the whole range of uint64_t.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+typedef struct {
+    uint64_t count[LAT_BUCKETS];
+    uint64_t total; /* Number of recorded values */
+    uint64_t max;
+} lat_hist_t;
+
+/* Current time in nanoseconds, for measuring intervals */
+static inline uint64_t lat_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Record a value in h */
+void lat_record(lat_hist_t *h, uint64_t value);
+
+/*
+ * Return the value below which the fraction q of the recorded values lie,
+ * rounded up to the end of its bucket, but not beyond the maximum.
+ */
+uint64_t lat_percentile(const lat_hist_t *h, double q);
+
+/* Forget all recorded values */
+void lat_reset(lat_hist_t *h);
+
+#endif /* LAB0_LATENCY_H */
@@ -0,0 +1,149 @@
+/* Hardware performance counters around console commands */
+
+#include "perf.h"
+
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "report.h"
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} events[PERF_NR_EVENTS] = {
+    [PERF_TASK_CLOCK] = {"ns task-clock", PERF_TYPE_SOFTWARE,
+                         PERF_COUNT_SW_TASK_CLOCK},
+    [PERF_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE,
+                           PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_LLC_MISSES] = {"LLC-misses", PERF_TYPE_HARDWARE,
+                         PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_BRANCH_MISSES] = {"branch-misses", PERF_TYPE_HARDWARE,
+                            PERF_COUNT_HW_BRANCH_MISSES},
+    [PERF_DTLB_MISSES] = {"dTLB-misses", PERF_TYPE_HW_CACHE,
+                          PERF_COUNT_HW_CACHE_DTLB |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+/* File descriptors of the counters, all in the group led by the first one */
+static int fds[PERF_NR_EVENTS];
+static int nr_open = 0;
+/* Which event each position in a group read belongs to */
+static int order[PERF_NR_EVENTS];
+static bool opened = false;
+
+/* Layout of a read of the whole group */
+typedef struct {
+    uint64_t nr;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[PERF_NR_EVENTS];
+} group_read_t;
+
+/*
+ * Counts when the current command started. Counts inherited from threads
+ * that have exited are not cleared by a reset, so samples are taken as
+ * differences instead.
+ */
+static group_read_t base;
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+    /* Count the calling thread on any CPU, and the threads it creates */
+    return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+static bool read_group(group_read_t *g)
+{
+    memset(g, 0, sizeof(*g));
+    return read(fds[0], g, sizeof(*g)) >= (ssize_t) (3 * sizeof(uint64_t));
+}
+
+static bool perf_open(void)
+{
+    opened = true;
+    for (int i = 0; i < PERF_NR_EVENTS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = !nr_open;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* Include the threads of a parallel sort */
+        attr.inherit = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        int fd = perf_event_open(&attr, nr_open ? fds[0] : -1);
+        if (fd < 0) {
+            /* Without a leader there is no group to count the rest in */
+            if (!nr_open)
+                return false;
+            continue;
+        }
+        fds[nr_open] = fd;
+        order[nr_open++] = i;
+    }
+    return true;
+}
+
+bool perf_start(void)
+{
+    if (!opened && !perf_open())
+        return false;
+    if (!nr_open)
+        return false;
+
+    read_group(&base);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+void perf_stop(perf_sample_t *s)
+{
+    ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    memset(s, 0, sizeof(*s));
+
+    group_read_t now;
+    if (!read_group(&now))
+        return;
+    uint64_t enabled = now.time_enabled - base.time_enabled;
+    uint64_t running = now.time_running - base.time_running;
+
+    /* Scale up the counts if the kernel had to multiplex the counters */
+    double scale = 1.0;
+    if (running && running < enabled)
+        scale = (double) enabled / running;
+    for (uint64_t i = 0; i < now.nr && i < (uint64_t) nr_open; i++) {
+        s->count[order[i]] = (uint64_t) ((now.values[i] - base.values[i]) *
+                                         scale);
+        s->valid[order[i]] = running > 0;
+    }
+}
+
+void perf_report(const perf_sample_t *s)
+{
+    char line[MAX_CHAR];
+    size_t len = 0;
+    for (int i = 0; i < PERF_NR_EVENTS && len < sizeof(line); i++) {
+        if (!s->valid[i])
+            continue;
+        len += snprintf(line + len, sizeof(line) - len, "%s%lu %s",
+                        len ? ", " : "", (unsigned long) s->count[i],
+                        events[i].name);
+    }
+    if (s->valid[PERF_CYCLES] && s->valid[PERF_INSTRUCTIONS] &&
+        s->count[PERF_CYCLES] && len < sizeof(line)) {
+        snprintf(line + len, sizeof(line) - len, " (%.2f IPC)",
+                 (double) s->count[PERF_INSTRUCTIONS] / s->count[PERF_CYCLES]);
+    }
+    report(1, "Perf: %s", len ? line : "no events counted");
+}
@@ -0,0 +1,40 @@
+#ifndef LAB0_PERF_H
+#define LAB0_PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Events counted around each command. The software task clock leads the
+ * group, so that something is counted even where the hardware events are
+ * missing, e.g., in a virtual machine.
+ */
+enum {
+    PERF_TASK_CLOCK,
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_NR_EVENTS
+};
+
+typedef struct {
+    uint64_t count[PERF_NR_EVENTS];
+    bool valid[PERF_NR_EVENTS]; /* Not every CPU or VM has every event */
+} perf_sample_t;
+
+/*
+ * Start the counters, opening them on first use. They count the calling
+ * thread and the threads it creates, e.g., those of a parallel sort.
+ * Return false if performance counters are not available.
+ */
+bool perf_start(void);
+
+/* Stop the counters and read them into s */
+void perf_stop(perf_sample_t *s);
+
+/* Report the counts in s on one line */
+void perf_report(const perf_sample_t *s);
+
+#endif /* LAB0_PERF_H */
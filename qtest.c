@@ -18,6 +18,7 @@
 /* Our program needs to use regular malloc/free */
 #define INTERNAL 1
 #include "harness.h"
+#include "latency.h"
 
 /* What character limit will be used for displaying strings? */
 #define MAXSTRING 1024
@@ -43,7 +44,6 @@
 /*
  * How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST 30
 static int big_list_size = BIG_LIST;
@@ -69,6 +69,47 @@ static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Remove elements without a buffer, reading the value from the element */
+static int zerocopy = 0;
+
+/* Queue operations whose latency is recorded */
+enum {
+    OP_IH,
+    OP_IT,
+    OP_IH_BULK,
+    OP_IT_BULK,
+    OP_RH,
+    OP_RT,
+    OP_RHN,
+    OP_RTN,
+    OP_REVERSE,
+    OP_SORT,
+    OP_SIZE,
+    OP_DM,
+    OP_DEDUP,
+    OP_SWAP,
+    OP_SHUFFLE,
+    NR_OPS
+};
+
+static const char *op_names[NR_OPS] = {
+    [OP_IH] = "ih",           [OP_IT] = "it",       [OP_IH_BULK] = "ih bulk",
+    [OP_IT_BULK] = "it bulk", [OP_RH] = "rh",       [OP_RT] = "rt",
+    [OP_RHN] = "rhn",         [OP_RTN] = "rtn",     [OP_REVERSE] = "reverse",
+    [OP_SORT] = "sort",       [OP_SIZE] = "size",   [OP_DM] = "dm",
+    [OP_DEDUP] = "dedup",     [OP_SWAP] = "swap",   [OP_SHUFFLE] = "shuffle",
+};
+
+static lat_hist_t op_latency[NR_OPS];
+
+/* Run stmt, recording how long it took as one instance of op */
+#define TIMED(op, stmt)                                  \
+    do {                                                 \
+        uint64_t start_ = lat_now();                     \
+        stmt;                                            \
+        lat_record(&op_latency[op], lat_now() - start_); \
+    } while (0)
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -88,12 +129,9 @@ static bool do_free(int argc, char *argv[])
         report(3, "Warning: Calling free on null queue");
     error_check();
 
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
-    set_cautious_mode(true);
 
     l_meta.size = 0;
     l_meta.l = NULL;
@@ -151,6 +189,75 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
+/*
+ * Insert reps copies of inserts (or reps random strings) with one call to
+ * the bulk insertion API, which either inserts all of them or none.
+ */
+static bool insert_bulk(bool to_head, char *inserts, bool need_rand, int reps)
+{
+    char **strs = malloc_or_fail(sizeof(char *) * reps, "insert_bulk");
+    char *randstrs = NULL;
+    if (need_rand)
+        randstrs =
+            malloc_or_fail((size_t) reps * MAX_RANDSTR_LEN, "insert_bulk");
+    for (int r = 0; r < reps; r++) {
+        if (need_rand) {
+            strs[r] = randstrs + (size_t) r * MAX_RANDSTR_LEN;
+            fill_rand_string(strs[r], MAX_RANDSTR_LEN);
+        } else {
+            strs[r] = inserts;
+        }
+    }
+
+    bool ok = true;
+    if (exception_setup(true)) {
+        bool rval;
+        TIMED(to_head ? OP_IH_BULK : OP_IT_BULK,
+              rval = to_head ? q_insert_head_bulk(l_meta.l, strs, NULL, reps)
+                             : q_insert_tail_bulk(l_meta.l, strs, NULL, reps));
+        if (rval) {
+            lcnt += reps;
+            l_meta.size += reps;
+            struct list_head *first = to_head ? l_meta.l->next : l_meta.l->prev;
+            struct list_head *second = to_head ? first->next : first->prev;
+            char *cur_inserts = list_entry(first, element_t, list)->value;
+            char *next_inserts = list_entry(second, element_t, list)->value;
+            if (!cur_inserts) {
+                report(1, "ERROR: Failed to save copy of string in queue");
+                ok = false;
+            } else if (cur_inserts == strs[reps - 1]) {
+                report(1,
+                       "ERROR: Need to allocate and copy string for new "
+                       "queue element");
+                ok = false;
+            } else if (cur_inserts == next_inserts) {
+                report(1,
+                       "ERROR: Need to allocate separate string for each "
+                       "queue element");
+                ok = false;
+            }
+        } else {
+            fail_count++;
+            if (fail_count < fail_limit)
+                report(2, "Insertion of %d elements failed", reps);
+            else {
+                report(1,
+                       "ERROR: Insertion of %d elements failed (%d failures "
+                       "total)",
+                       reps, fail_count);
+                ok = false;
+            }
+        }
+        ok = ok && !error_check();
+    }
+    exception_cancel();
+
+    if (randstrs)
+        free_block(randstrs, (size_t) reps * MAX_RANDSTR_LEN);
+    free_block(strs, sizeof(char *) * reps);
+    return ok;
+}
+
 /* insert head */
 static bool do_ih(int argc, char *argv[])
 {
@@ -159,6 +266,8 @@ static bool do_ih(int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
+        /* dudect prints its progress through stdio */
+        report_flush();
         bool ok = is_insert_head_const();
         if (!ok) {
             report(1, "ERROR: Probably not constant time");
@@ -194,11 +303,18 @@ static bool do_ih(int argc, char *argv[])
         report(3, "Warning: Calling insert head on null queue");
     error_check();
 
+    if (reps > 1 && l_meta.l) {
+        ok = insert_bulk(true, inserts, need_rand, reps);
+        show_queue(3);
+        return ok;
+    }
+
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = q_insert_head(l_meta.l, inserts);
+            bool rval;
+            TIMED(OP_IH, rval = q_insert_head(l_meta.l, inserts));
             if (rval) {
                 lcnt++;
                 l_meta.size++;
@@ -249,6 +365,7 @@ static bool do_it(int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
+        report_flush();
         bool ok = is_insert_tail_const();
         if (!ok) {
             report(1, "ERROR: Probably not constant time");
@@ -283,11 +400,18 @@ static bool do_it(int argc, char *argv[])
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
 
+    if (reps > 1 && l_meta.l) {
+        ok = insert_bulk(false, inserts, need_rand, reps);
+        show_queue(3);
+        return ok;
+    }
+
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = q_insert_tail(l_meta.l, inserts);
+            bool rval;
+            TIMED(OP_IT, rval = q_insert_tail(l_meta.l, inserts));
             if (rval) {
                 lcnt++;
                 l_meta.size++;
@@ -330,6 +454,7 @@ static bool do_remove(int option, int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
+        report_flush();
         bool ok = option ? is_remove_tail_const() : is_remove_head_const();
         if (!ok) {
             report(1, "ERROR: Probably not constant time");
@@ -376,14 +501,25 @@ static bool do_remove(int option, int argc, char *argv[])
     error_check();
 
     element_t *re = NULL;
+    char *sp = zerocopy ? NULL : removes;
     if (exception_setup(true))
-        re = option ? q_remove_tail(l_meta.l, removes, string_length + 1)
-                    : q_remove_head(l_meta.l, removes, string_length + 1);
+        TIMED(option ? OP_RT : OP_RH,
+              re = option ? q_remove_tail(l_meta.l, sp, string_length + 1)
+                          : q_remove_head(l_meta.l, sp, string_length + 1));
     exception_cancel();
 
     bool is_null = re ? false : true;
 
     if (!is_null) {
+        /* Nothing was copied, so take the value for checking from the node */
+        if (zerocopy) {
+            size_t len = strlen(re->value);
+            if (len > (size_t) string_length)
+                len = string_length;
+            memcpy(removes, re->value, len);
+            removes[len] = '\0';
+        }
+
         // q_remove_head and q_remove_tail are not responsible for releasing
         // node
         q_release_element(re);
@@ -445,6 +581,68 @@ static inline bool do_rt(int argc, char *argv[])
     return do_remove(1, argc, argv);
 }
 
+static bool do_remove_n(int option, int argc, char *argv[])
+{
+    // option 0 is for remove head; option 1 is for remove tail
+
+    int k;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &k) || k < 1) {
+        report(1, "Invalid number of removals '%s'", argv[1]);
+        return false;
+    }
+
+    if (!l_meta.size)
+        report(3, "Warning: Calling remove on empty queue");
+    error_check();
+
+    bool ok = true;
+    int expect = k < l_meta.size ? k : l_meta.size;
+    int n = 0;
+    LIST_HEAD(removed);
+    if (exception_setup(true))
+        TIMED(option ? OP_RTN : OP_RHN,
+              n = option ? q_remove_tail_n(l_meta.l, &removed, k)
+                         : q_remove_head_n(l_meta.l, &removed, k));
+    exception_cancel();
+
+    if (n != expect) {
+        report(1, "ERROR: Removed %d elements, but expected %d", n, expect);
+        ok = false;
+    }
+
+    int cnt = 0;
+    element_t *e, *safe;
+    list_for_each_entry_safe (e, safe, &removed, list) {
+        report(2, "Removed %s from queue", e->value);
+        q_release_element(e);
+        cnt++;
+    }
+    if (cnt != n) {
+        report(1, "ERROR: Detached list holds %d elements, but %d reported",
+               cnt, n);
+        ok = false;
+    }
+    lcnt -= cnt;
+    l_meta.size -= cnt;
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static inline bool do_rhn(int argc, char *argv[])
+{
+    return do_remove_n(0, argc, argv);
+}
+
+static inline bool do_rtn(int argc, char *argv[])
+{
+    return do_remove_n(1, argc, argv);
+}
+
 /* remove head quietly */
 static bool do_rhq(int argc, char *argv[])
 {
@@ -461,7 +659,7 @@ static bool do_rhq(int argc, char *argv[])
     element_t *re = NULL;
 
     if (exception_setup(true))
-        re = q_remove_head(l_meta.l, NULL, 0);
+        TIMED(OP_RH, re = q_remove_head(l_meta.l, NULL, 0));
     exception_cancel();
 
     if (re) {
@@ -496,7 +694,7 @@ static bool do_dedup(int argc, char *argv[])
     bool ok = true;
     // set_noallocate_mode(true);
     if (exception_setup(true))
-        ok = q_delete_dup(l_meta.l);
+        TIMED(OP_DEDUP, ok = q_delete_dup(l_meta.l));
     exception_cancel();
 
     // set_noallocate_mode(false);
@@ -507,9 +705,11 @@ static bool do_dedup(int argc, char *argv[])
     }
 
     element_t *item = NULL;
+    size_t cnt = 0;
     if (l_meta.size) {
         list_for_each_entry (item, l_meta.l, list) {
             element_t *next_item;
+            cnt++;
             if (item->list.next == l_meta.l)
                 break;
             next_item = list_entry(item->list.next, element_t, list);
@@ -522,6 +722,11 @@ static bool do_dedup(int argc, char *argv[])
             }
         }
     }
+    /* Keep track of the elements deleted by q_delete_dup */
+    if (ok) {
+        lcnt = cnt;
+        l_meta.size = cnt;
+    }
     show_queue(3);
 
     return ok && !error_check();
@@ -540,7 +745,7 @@ static bool do_reverse(int argc, char *argv[])
 
     set_noallocate_mode(true);
     if (exception_setup(true))
-        q_reverse(l_meta.l);
+        TIMED(OP_REVERSE, q_reverse(l_meta.l));
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -575,7 +780,7 @@ static bool do_size(int argc, char *argv[])
 
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
-            cnt = q_size(l_meta.l);
+            TIMED(OP_SIZE, cnt = q_size(l_meta.l));
             ok = ok && !error_check();
         }
     }
@@ -613,14 +818,23 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
-    set_noallocate_mode(true);
+    /* Array sorting needs scratch space, which must be given back */
+    bool allocate = q_sort_algo == Q_SORT_ARRAY;
+    size_t bcnt = allocation_check();
+
+    set_noallocate_mode(!allocate);
     if (exception_setup(true))
-        q_sort(l_meta.l);
+        TIMED(OP_SORT, q_sort(l_meta.l));
     exception_cancel();
     set_noallocate_mode(false);
 
     bool ok = true;
-    if (l_meta.size) {
+    if (allocate && allocation_check() != bcnt) {
+        report(1, "ERROR: Sorting leaked %lu blocks",
+               allocation_check() - bcnt);
+        ok = false;
+    }
+    if (ok && l_meta.size) {
         for (struct list_head *cur_l = l_meta.l->next;
              cur_l != l_meta.l && --cnt; cur_l = cur_l->next) {
             /* Ensure each element in ascending order */
@@ -653,9 +867,14 @@ static bool do_dm(int argc, char *argv[])
 
     bool ok = true;
     if (exception_setup(true))
-        ok = q_delete_mid(l_meta.l);
+        TIMED(OP_DM, ok = q_delete_mid(l_meta.l));
     exception_cancel();
 
+    if (ok) {
+        lcnt--;
+        l_meta.size--;
+    }
+
     show_queue(3);
     return ok && !error_check();
 }
@@ -673,7 +892,7 @@ static bool do_swap(int argc, char *argv[])
 
     set_noallocate_mode(true);
     if (exception_setup(true))
-        q_swap(l_meta.l);
+        TIMED(OP_SWAP, q_swap(l_meta.l));
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -763,50 +982,135 @@ static bool do_show(int argc, char *argv[])
     return show_queue(0);
 }
 
-void q_shuffle(struct list_head *head)
+static bool do_shuffle(int argc, char *argv[])
 {
-    if (!head || list_empty(head) || list_is_singular(head))
-        return;
-
-    srand(time(NULL));
-    int length = q_size(head) - 1;
-    int count = length + 1;
-    struct list_head *tail = head, *tmp = head, *rand_ptr = head;
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
 
-    for (int i = 0; i < length; i++) {
-        int rand_num;
-        rand_num = rand() % (count - 1) + 1;
-        for (int j = 0; j < count; j++) {
-            if (j < rand_num)
-                rand_ptr = tmp = tmp->next;
-            tail = tail->next;
+    int seed;
+    if (argc == 2) {
+        if (!get_int(argv[1], &seed)) {
+            report(1, "Invalid seed '%s'", argv[1]);
+            return false;
         }
-        tmp = rand_ptr->prev;
-        list_del(rand_ptr);
-        list_add(rand_ptr, tail);
-        list_del(tail);
-        list_add(tail, tmp);
+        q_shuffle_seed(seed);
+    }
+
+    if (!l_meta.l) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
+
+    bool ok = true;
+    size_t bcnt = allocation_check();
+    if (exception_setup(true))
+        TIMED(OP_SHUFFLE, ok = q_shuffle(l_meta.l));
+    exception_cancel();
 
-        rand_ptr = tail = tmp = head;
-        count--;
+    if (!ok) {
+        report(1, "ERROR: Could not allocate space to shuffle queue");
+    } else if (allocation_check() != bcnt) {
+        report(1, "ERROR: Shuffling leaked %lu blocks",
+               allocation_check() - bcnt);
+        ok = false;
     }
+
+    show_queue(0);
+    return ok && !error_check();
 }
 
-static bool do_shuffle(int argc, char *argv[])
+static bool do_allocstat(int argc, char *argv[])
 {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
 
-    if (!l_meta.l) {
-        report(3, "Warning: Try to access null queue");
+    report_alloc_sites(false);
+    return true;
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        for (int op = 0; op < NR_OPS; op++)
+            lat_reset(&op_latency[op]);
+        return true;
+    }
+    if (argc != 1) {
+        report(1, "%s takes no arguments or 'reset'", argv[0]);
         return false;
     }
 
-    q_shuffle(l_meta.l);
+    report(1, "%-8s %10s %10s %10s %10s %10s %10s", "op", "count", "p50",
+           "p90", "p99", "p99.9", "max");
+    for (int op = 0; op < NR_OPS; op++) {
+        const lat_hist_t *h = &op_latency[op];
+        if (!h->total)
+            continue;
+        report(1, "%-8s %10lu %10lu %10lu %10lu %10lu %10lu", op_names[op],
+               h->total, lat_percentile(h, 0.5), lat_percentile(h, 0.9),
+               lat_percentile(h, 0.99), lat_percentile(h, 0.999), h->max);
+    }
+    report(1, "Latencies in nanoseconds");
+    return true;
+}
 
-    return show_queue(0);
+static bool do_memstat(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    mem_stat_t ms;
+    mem_stat(&ms);
+    size_t slack = ms.footprint_bytes - ms.payload_bytes - ms.overhead_bytes;
+    report(1, "Live blocks: %lu", ms.blocks);
+    report(1, "Payload: %lu bytes", ms.payload_bytes);
+    report(1, "Harness header/footer: %lu bytes", ms.overhead_bytes);
+    report(1, "Allocator slack: %lu bytes", slack);
+    report(1, "Footprint: %lu bytes", ms.footprint_bytes);
+    if (lcnt > 0) {
+        /* What the queue would take without the headers of the harness */
+        report(1,
+               "Per element (%d elements): %.1f bytes payload, %.1f bytes "
+               "with slack, %.1f bytes with harness overhead",
+               lcnt, (double) ms.payload_bytes / lcnt,
+               (double) (ms.payload_bytes + slack) / lcnt,
+               (double) ms.footprint_bytes / lcnt);
+    }
+
+    report(1, "Live blocks by payload size:");
+    for (int k = 0; k < 65; k++) {
+        if (!ms.size_hist[k])
+            continue;
+        size_t lo = k ? (size_t) 1 << (k - 1) : 0;
+        size_t hi = k ? ((size_t) 1 << (k - 1)) * 2 - 1 : 0;
+        report(1, "  %10lu - %-10lu %lu", lo, hi, ms.size_hist[k]);
+    }
+
+    size_t current, peak;
+    memory_usage(&current, &peak);
+    report(1, "Interpreter: %lu bytes, peak %lu bytes", current, peak);
+    return true;
+}
+
+/* Count allocations for the fault schedule from the moment it is changed */
+static void fault_setter(int oldval)
+{
+    reset_fault_schedule();
+}
+
+static void threads_setter(int oldval)
+{
+    if (q_sort_threads < 1) {
+        report(1, "Number of threads must be at least 1");
+        q_sort_threads = oldval;
+    }
 }
 
 static void console_init()
@@ -829,6 +1133,12 @@ static void console_init()
         rt,
         " [str]          | Remove from tail of queue.  Optionally compare "
         "to expected value str");
+    ADD_COMMAND(rhn,
+                " n              | Remove n elements from head of queue at "
+                "once");
+    ADD_COMMAND(rtn,
+                " n              | Remove n elements from tail of queue at "
+                "once");
     ADD_COMMAND(
         rhq,
         "                | Remove from head of queue without reporting value.");
@@ -842,13 +1152,55 @@ static void console_init()
         dedup, "                | Delete all nodes that have duplicate string");
     ADD_COMMAND(swap,
                 "                | Swap every two adjacent nodes in queue");
-    ADD_COMMAND(shuffle, "                | Suffle the elements in queue");
+    ADD_COMMAND(shuffle,
+                " [seed]         | Shuffle the elements in queue, optionally "
+                "reseeding the random number generator first");
+    ADD_COMMAND(allocstat,
+                "                | Show allocations per call site, live and "
+                "in total");
+    ADD_COMMAND(stats,
+                " [reset]        | Show latency percentiles of queue "
+                "operations, or clear them");
+    ADD_COMMAND(memstat,
+                "                | Show memory taken by live blocks and per "
+                "queue element");
+    add_param("timeout", &time_limit,
+              "Time limit of each operation in milliseconds (0: none)", NULL);
+    add_param("cputime", &time_limit_cpu,
+              "Count time limit in CPU time rather than wall-clock time",
+              NULL);
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
+              fault_setter);
+    add_param("fail_nth", &fail_nth, "Fail the nth allocation from now",
+              fault_setter);
+    add_param("fail_every", &fail_every,
+              "Fail every nth allocation, counted from now", fault_setter);
+    add_param("fail_size", &fail_size,
+              "Fail allocations in the power-of-2 size class of this size",
               NULL);
+    add_param("fail_seed", &fail_seed,
+              "Seed replaying malloc failures deterministically", fault_setter);
+    add_param("poison", &poison_rate,
+              "Percent of blocks filled in full on malloc and free", NULL);
+    add_param("guard", &guard_mode,
+              "Place blocks in front of guard pages to trap overruns", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("layout", &q_layout,
+              "Element layout of new queues (0: separate string, 1: inline "
+              "string, 2: arena)",
+              NULL);
+    add_param("sort", &q_sort_algo,
+              "Sorting algorithm (0: merge sort, 1: natural merge sort, 2: "
+              "array sort, 3: radix sort)",
+              NULL);
+    add_param("threads", &q_sort_threads, "Number of threads used by sort",
+              threads_setter);
+    add_param("zerocopy", &zerocopy,
+              "Remove without a buffer, leaving the string in the element",
+              NULL);
 }
 
 /* Signal handlers */
@@ -857,6 +1209,8 @@ static void sigsegvhandler(int sig)
     report(1,
            "Segmentation fault occurred.  You dereferenced a NULL or invalid "
            "pointer");
+    /* abort skips the atexit handlers, so write out queued reports now */
+    report_flush();
     /* Raising a SIGABRT signal to produce a core dump for debugging. */
     abort();
 }
@@ -879,18 +1233,15 @@ static void queue_init()
 static bool queue_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
-
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
         report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
                bcnt);
+        report_alloc_sites(true);
         return false;
     }
 
@@ -899,11 +1250,12 @@ static bool queue_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-j JFILE]\n", cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-j JFILE   Write metrics of each command to JFILE as JSON lines\n");
     exit(0);
 }
 
@@ -952,10 +1304,12 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char jbuf[BUFSIZE];
+    char *metricsfile_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:j:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -980,6 +1334,11 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'j':
+            strncpy(jbuf, optarg, BUFSIZE);
+            jbuf[BUFSIZE - 1] = '\0';
+            metricsfile_name = jbuf;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1003,6 +1362,10 @@ int main(int argc, char *argv[])
     }
     if (logfile_name)
         set_logfile(logfile_name);
+    if (metricsfile_name && !set_metricsfile(metricsfile_name)) {
+        fprintf(stderr, "Cannot open metrics file '%s'\n", metricsfile_name);
+        exit(EXIT_FAILURE);
+    }
 
     add_quit_helper(queue_quit);
 
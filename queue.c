@@ -1,6 +1,10 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "harness.h"
 #include "queue.h"
@@ -11,34 +15,265 @@
  *   cppcheck-suppress nullPointer
  */
 
+/* Element layout given to queues created by q_new */
+int q_layout = Q_LAYOUT_SPLIT;
+
+/* Algorithm used by q_sort */
+int q_sort_algo = Q_SORT_MERGE;
+
+/* Number of threads q_sort may use */
+int q_sort_threads = 1;
+
+/* Capacity of the slabs backing an arena queue */
+#define SLAB_SIZE (64 * 1024)
+
+/* Slabs of an arena queue are kept in a singly-linked list */
+typedef struct SLAB slab_t;
+struct SLAB {
+    slab_t *next;
+    size_t used, size;
+    unsigned char mem[];
+};
+
+/*
+ * Queue descriptor.
+ * The struct list_head handed out by q_new is the first member, so every
+ * operation can get back to the descriptor with container_of.
+ */
+typedef struct {
+    struct list_head head;
+    /* Number of elements, kept up to date by every operation */
+    size_t size;
+    int layout;
+    /* Slabs holding the elements of an arena queue, most recent first */
+    slab_t *slabs;
+} queue_t;
+
+/*
+ * Block holding all the elements of one bulk insertion.
+ * It is freed once the last of its elements is released.
+ */
+typedef struct {
+    size_t live;
+} batch_t;
+
+/* Batch of the elements carved out of a slab, which are never freed alone */
+static batch_t arena_batch;
+
+/*
+ * Element as allocated by the split layout. Every layout records the length
+ * of the string, so that removal copies exactly the bytes needed, and the
+ * layout the element was allocated in, so that q_release_element knows how
+ * to free it.
+ */
+typedef struct {
+    element_t ele;
+    size_t len;
+    int layout;
+} sized_element_t;
+
+/*
+ * Element with its string stored right behind it, so that a single
+ * allocation holds both. Its layout is Q_LAYOUT_ARENA if it was carved out
+ * of a slab, Q_LAYOUT_INLINE otherwise.
+ */
+typedef struct {
+    element_t ele;
+    size_t len;
+    int layout;
+    /* Block the element lives in, or NULL if it was allocated on its own */
+    batch_t *batch;
+    char str[];
+} inline_element_t;
+
+_Static_assert(offsetof(sized_element_t, len) ==
+                       offsetof(inline_element_t, len) &&
+                   offsetof(sized_element_t, layout) ==
+                       offsetof(inline_element_t, layout),
+               "element length and layout must be reachable in every layout");
+
+static inline size_t ele_len(const element_t *e)
+{
+    return container_of(e, sized_element_t, ele)->len;
+}
+
+/* Size of an inline element holding a string of len characters */
+static inline size_t inline_size(size_t len)
+{
+    size_t size = offsetof(inline_element_t, str) + len + 1;
+    return (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+/* Set up the inline element at p with a copy of the len characters at s */
+static inline element_t *inline_init(void *p,
+                                     batch_t *batch,
+                                     const char *s,
+                                     size_t len)
+{
+    inline_element_t *node = p;
+    node->ele.value = node->str;
+    node->len = len;
+    node->layout = batch == &arena_batch ? Q_LAYOUT_ARENA : Q_LAYOUT_INLINE;
+    node->batch = batch;
+    memcpy(node->str, s, len);
+    node->str[len] = '\0';
+    return &node->ele;
+}
+
+static inline queue_t *to_queue(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+/*
+ * Carve size bytes out of the current slab of queue q, starting a new slab
+ * when it is full. Oversized requests get a slab of their own, which is
+ * linked behind the current one so that its free space is not lost.
+ * Return NULL if could not allocate space.
+ */
+static void *arena_alloc(queue_t *q, size_t size)
+{
+    slab_t *slab = q->slabs;
+    if (!slab || slab->size - slab->used < size) {
+        size_t cap = size > SLAB_SIZE ? size : SLAB_SIZE;
+        slab_t *new = malloc(sizeof(slab_t) + cap);
+        if (!new)
+            return NULL;
+        new->used = 0;
+        new->size = cap;
+        if (slab && cap > SLAB_SIZE) {
+            new->next = slab->next;
+            slab->next = new;
+        } else {
+            new->next = slab;
+            q->slabs = new;
+        }
+        slab = new;
+    }
+
+    void *p = slab->mem + slab->used;
+    slab->used += size;
+    return p;
+}
+
+/*
+ * Allocate an element holding a copy of s in the layout of queue q.
+ * Return NULL if could not allocate space.
+ */
+static element_t *ele_alloc(queue_t *q, const char *s)
+{
+    size_t len = strlen(s);
+
+    if (q->layout == Q_LAYOUT_ARENA) {
+        void *p = arena_alloc(q, inline_size(len));
+        return p ? inline_init(p, &arena_batch, s, len) : NULL;
+    }
+    if (q->layout == Q_LAYOUT_INLINE) {
+        void *p = malloc(inline_size(len));
+        return p ? inline_init(p, NULL, s, len) : NULL;
+    }
+
+    sized_element_t *new = malloc(sizeof(sized_element_t));
+    if (!new)
+        return NULL;
+    new->ele.value = malloc(len + 1);
+    if (!new->ele.value) {
+        free(new);
+        return NULL;
+    }
+    memcpy(new->ele.value, s, len + 1);
+    new->len = len;
+    new->layout = Q_LAYOUT_SPLIT;
+    return &new->ele;
+}
+
+/*
+ * Allocate n elements holding copies of the strings in s, all from a single
+ * block, and link them into list in order, or in reverse order if reverse
+ * is set.
+ * Return false if could not allocate space.
+ */
+static bool batch_alloc(queue_t *q,
+                        struct list_head *list,
+                        char **s,
+                        const size_t *lens,
+                        size_t n,
+                        bool reverse)
+{
+    size_t total = q->layout == Q_LAYOUT_ARENA ? 0 : sizeof(batch_t);
+    for (size_t i = 0; i < n; i++)
+        total += inline_size(lens ? lens[i] : strlen(s[i]));
+
+    unsigned char *p;
+    batch_t *batch;
+    if (q->layout == Q_LAYOUT_ARENA) {
+        p = arena_alloc(q, total);
+        batch = &arena_batch;
+    } else {
+        p = malloc(total);
+        batch = (batch_t *) p;
+        if (p) {
+            batch->live = n;
+            p += sizeof(batch_t);
+        }
+    }
+    if (!p)
+        return false;
+
+    for (size_t i = 0; i < n; i++) {
+        size_t len = lens ? lens[i] : strlen(s[i]);
+        element_t *e = inline_init(p, batch, s[i], len);
+        if (reverse)
+            list_add(&e->list, list);
+        else
+            list_add_tail(&e->list, list);
+        p += inline_size(len);
+    }
+    return true;
+}
+
 /*
  * Create empty queue.
  * Return NULL if could not allocate space.
  */
 struct list_head *q_new()
 {
-    struct list_head *new_head = malloc(sizeof(struct list_head));
-    if (new_head) {
-        INIT_LIST_HEAD(new_head);
-        return new_head;
-    }
-    free(new_head);
-    return NULL;
+    queue_t *q = malloc(sizeof(queue_t));
+    if (!q)
+        return NULL;
+
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    q->layout = q_layout;
+    q->slabs = NULL;
+    return &q->head;
 }
 
-/* Free all storage used by queue */
+/*
+ * Free all storage used by queue.
+ * An arena queue drops its slabs as a whole instead of visiting every node.
+ */
 void q_free(struct list_head *l)
 {
     if (!l)
         return;
 
-    struct list_head *tmp = l->next;
-    while (tmp != l) {
-        element_t *ptr = list_entry(tmp, element_t, list);
-        tmp = tmp->next;
-        q_release_element(ptr);
+    queue_t *q = to_queue(l);
+    if (q->layout == Q_LAYOUT_ARENA) {
+        while (q->slabs) {
+            slab_t *slab = q->slabs;
+            q->slabs = slab->next;
+            free(slab);
+        }
+    } else {
+        struct list_head *tmp = l->next;
+        while (tmp != l) {
+            element_t *ptr = list_entry(tmp, element_t, list);
+            tmp = tmp->next;
+            q_release_element(ptr);
+        }
     }
-    free(l);
+    free(q);
 }
 
 /*
@@ -50,21 +285,15 @@ void q_free(struct list_head *l)
  */
 bool q_insert_head(struct list_head *head, char *s)
 {
-    if (!head)
+    if (!head || !s)
         return false;
 
-    element_t *new = malloc(sizeof(element_t));
-    if (new &&s) {
-        new->value = malloc((strlen(s) + 1) * sizeof(char));
-        if (new->value) {
-            strncpy(new->value, s, strlen(s));
-            *(new->value + strlen(s)) = '\0';
-            list_add(&new->list, head);
-            return true;
-        }
-    }
-    free(new);
-    return false;
+    element_t *new = ele_alloc(to_queue(head), s);
+    if (!new)
+        return false;
+    list_add(&new->list, head);
+    to_queue(head)->size++;
+    return true;
 }
 
 /*
@@ -76,21 +305,82 @@ bool q_insert_head(struct list_head *head, char *s)
  */
 bool q_insert_tail(struct list_head *head, char *s)
 {
-    if (!head)
+    if (!head || !s)
         return false;
 
-    element_t *new = malloc(sizeof(element_t));
-    if (new &&s) {
-        new->value = malloc((strlen(s) + 1) * sizeof(char));
-        if (new->value) {
-            strncpy(new->value, s, strlen(s));
-            *(new->value + strlen(s)) = '\0';
-            list_add_tail(&new->list, head);
-            return true;
-        }
-    }
-    free(new);
-    return false;
+    element_t *new = ele_alloc(to_queue(head), s);
+    if (!new)
+        return false;
+    list_add_tail(&new->list, head);
+    to_queue(head)->size++;
+    return true;
+}
+
+/*
+ * Attempt to insert n elements at head of queue, as if q_insert_head were
+ * called on s[0], ..., s[n - 1] in turn.
+ * If lens is non-NULL, lens[i] gives the number of characters to copy from
+ * s[i]; otherwise the strings must be null-terminated.
+ * All elements and strings are allocated as one block and spliced into the
+ * queue at once. Either all of them are inserted, or none.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space.
+ */
+bool q_insert_head_bulk(struct list_head *head,
+                        char **s,
+                        const size_t *lens,
+                        size_t n)
+{
+    if (!head || !s)
+        return false;
+    if (!n)
+        return true;
+
+    LIST_HEAD(batch);
+    if (!batch_alloc(to_queue(head), &batch, s, lens, n, true))
+        return false;
+    list_splice(&batch, head);
+    to_queue(head)->size += n;
+    return true;
+}
+
+/*
+ * Attempt to insert n elements at tail of queue, as if q_insert_tail were
+ * called on s[0], ..., s[n - 1] in turn.
+ * Other attribute is as same as q_insert_head_bulk.
+ */
+bool q_insert_tail_bulk(struct list_head *head,
+                        char **s,
+                        const size_t *lens,
+                        size_t n)
+{
+    if (!head || !s)
+        return false;
+    if (!n)
+        return true;
+
+    LIST_HEAD(batch);
+    if (!batch_alloc(to_queue(head), &batch, s, lens, n, false))
+        return false;
+    list_splice_tail(&batch, head);
+    to_queue(head)->size += n;
+    return true;
+}
+
+/*
+ * Copy the string of element e into sp, truncated to bufsize - 1 characters.
+ * Unlike strncpy, the rest of the buffer is left untouched.
+ */
+static inline void copy_value(const element_t *e, char *sp, size_t bufsize)
+{
+    if (!sp || !bufsize)
+        return;
+
+    size_t len = ele_len(e);
+    if (len > bufsize - 1)
+        len = bufsize - 1;
+    memcpy(sp, e->value, len);
+    sp[len] = '\0';
 }
 
 /*
@@ -114,11 +404,9 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 
     element_t *rm_ele = container_of(head->next, element_t, list);
     list_del(head->next);
+    to_queue(head)->size--;
 
-    if (sp) {
-        strncpy(sp, rm_ele->value, bufsize - 1);
-        *(sp + bufsize - 1) = '\0';
-    }
+    copy_value(rm_ele, sp, bufsize);
     return rm_ele;
 }
 
@@ -133,40 +421,112 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 
     element_t *rm_ele = container_of(head->prev, element_t, list);
     list_del(head->prev);
+    to_queue(head)->size--;
 
-    if (sp) {
-        strncpy(sp, rm_ele->value, bufsize - 1);
-        *(sp + bufsize - 1) = '\0';
-    }
+    copy_value(rm_ele, sp, bufsize);
     return rm_ele;
 }
 
+/* Return the k-th node of queue q, walking in from whichever end is nearer */
+static struct list_head *nth_node(queue_t *q, size_t k)
+{
+    struct list_head *node = &q->head;
+    if (k <= q->size / 2) {
+        for (size_t i = 0; i < k; i++)
+            node = node->next;
+    } else {
+        for (size_t i = q->size - k + 1; i; i--)
+            node = node->prev;
+    }
+    return node;
+}
+
+/*
+ * Attempt to remove the first k elements of queue as a whole.
+ * They are moved in order into list, whose previous content is replaced.
+ * Only O(k) pointers are followed and no string is copied; the caller takes
+ * over the elements and has to release them.
+ * Return the number of elements removed, which is less than k if the queue
+ * holds fewer elements.
+ */
+int q_remove_head_n(struct list_head *head, struct list_head *list, int k)
+{
+    if (!list)
+        return 0;
+    INIT_LIST_HEAD(list);
+    if (!head || k <= 0 || list_empty(head))
+        return 0;
+
+    queue_t *q = to_queue(head);
+    size_t n = (size_t) k < q->size ? (size_t) k : q->size;
+    list_cut_position(list, head, nth_node(q, n));
+    q->size -= n;
+    return n;
+}
+
+/*
+ * Attempt to remove the last k elements of queue as a whole.
+ * Other attribute is as same as q_remove_head_n.
+ */
+int q_remove_tail_n(struct list_head *head, struct list_head *list, int k)
+{
+    if (!list)
+        return 0;
+    INIT_LIST_HEAD(list);
+    if (!head || k <= 0 || list_empty(head))
+        return 0;
+
+    queue_t *q = to_queue(head);
+    size_t n = (size_t) k < q->size ? (size_t) k : q->size;
+    if (n < q->size) {
+        LIST_HEAD(front);
+        list_cut_position(&front, head, nth_node(q, q->size - n));
+        list_splice_init(head, list);
+        list_splice(&front, head);
+    } else {
+        list_splice_init(head, list);
+    }
+    q->size -= n;
+    return n;
+}
+
 /*
- * WARN: This is for external usage, don't modify it
  * Attempt to release element.
+ * All layouts are handled: the string is only freed on its own when it was
+ * not allocated together with the element, and elements living in an arena
+ * are left alone since q_free reclaims their slabs.
  */
 void q_release_element(element_t *e)
 {
-    free(e->value);
-    free(e);
+    switch (container_of(e, sized_element_t, ele)->layout) {
+    case Q_LAYOUT_SPLIT:
+        free(e->value);
+        free(e);
+        break;
+    case Q_LAYOUT_INLINE: {
+        inline_element_t *node = container_of(e, inline_element_t, ele);
+        if (!node->batch)
+            free(e);
+        else if (!--node->batch->live)
+            free(node->batch);
+        break;
+    }
+    default:
+        break;
+    }
 }
 
 /*
  * Return number of elements in queue.
  * Return 0 if q is NULL or empty
+ * The count is cached in the queue descriptor, so this takes O(1).
  */
 int q_size(struct list_head *head)
 {
     if (!head)
         return 0;
 
-    int len = 0;
-    struct list_head *li;
-
-    list_for_each (li, head)
-        len++;
-
-    return len;
+    return to_queue(head)->size;
 }
 
 /*
@@ -192,6 +552,7 @@ bool q_delete_mid(struct list_head *head)
     }
 
     list_del(second);
+    to_queue(head)->size--;
     element_t *mid_ele = list_entry(second, element_t, list);
     q_release_element(mid_ele);
     return true;
@@ -221,6 +582,7 @@ bool q_delete_dup(struct list_head *head)
         while (!strcmp(ele_dup->value, ele_dup_next->value)) {
             if_dup = tmp;
             list_del(tmp->next);
+            to_queue(head)->size--;
             q_release_element(ele_dup_next);
             ele_dup_next = list_entry(tmp->next, element_t, list);
             if (tmp->next == head)
@@ -231,6 +593,7 @@ bool q_delete_dup(struct list_head *head)
         if (if_dup) {
             element_t *ele_dup_a = list_entry(if_dup, element_t, list);
             list_del(if_dup);
+            to_queue(head)->size--;
             q_release_element(ele_dup_a);
             if_dup = NULL;
         }
@@ -278,94 +641,862 @@ void q_reverse(struct list_head *head)
         next = next->next;
     } while (cur != head);
 }
+
+/* Compare the strings of the elements embedding a and b */
+static inline int ele_cmp(const struct list_head *a, const struct list_head *b)
+{
+    return strcmp(list_entry(a, element_t, list)->value,
+                  list_entry(b, element_t, list)->value);
+}
+
 /*
- * Sort elements of queue in ascending order
- * No effect if q is NULL or empty. In addition, if q has only one
- * element, do nothing.
+ * Merge two NULL-terminated, singly-linked sorted lists.
+ * Elements of a go first when equal, which keeps the sort stable.
+ * The prev pointers are left untouched.
  */
-struct list_head *sep_list(struct list_head *head);
-struct list_head *merge_list(struct list_head *left, struct list_head *right);
+static struct list_head *merge(struct list_head *a, struct list_head *b)
+{
+    struct list_head *head = NULL, **tail = &head;
 
-void q_sort(struct list_head *head)
+    for (;;) {
+        if (ele_cmp(a, b) <= 0) {
+            *tail = a;
+            tail = &a->next;
+            a = a->next;
+            if (!a) {
+                *tail = b;
+                break;
+            }
+        } else {
+            *tail = b;
+            tail = &b->next;
+            b = b->next;
+            if (!b) {
+                *tail = a;
+                break;
+            }
+        }
+    }
+    return head;
+}
+
+/*
+ * Do the last merge straight into the circular list at head, rebuilding the
+ * prev pointers on the way.
+ */
+static void merge_final(struct list_head *head,
+                        struct list_head *a,
+                        struct list_head *b)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
-        return;
+    struct list_head *tail = head;
+
+    for (;;) {
+        if (ele_cmp(a, b) <= 0) {
+            tail->next = a;
+            a->prev = tail;
+            tail = a;
+            a = a->next;
+            if (!a)
+                break;
+        } else {
+            tail->next = b;
+            b->prev = tail;
+            tail = b;
+            b = b->next;
+            if (!b) {
+                b = a;
+                break;
+            }
+        }
+    }
+
+    /* Splice the remaining elements and fix up their prev pointers */
+    do {
+        tail->next = b;
+        b->prev = tail;
+        tail = b;
+        b = b->next;
+    } while (b);
 
-    struct list_head *new_head = head->next;
-    list_del(head);
-    new_head = sep_list(new_head);
-    list_add_tail(head, new_head);
+    tail->next = head;
+    head->prev = tail;
 }
 
-struct list_head *sep_list(struct list_head *head)
+/*
+ * This is the bottom-up merge sort of Linux's lib/list_sort.c. Elements are
+ * moved one by one onto a list of pending sublists, chained through their
+ * prev pointers, and two pending sublists of size 2^k are merged as soon as a
+ * third one follows them. Merges are thus kept at most 2:1 unbalanced, the
+ * sort needs neither recursion nor extra memory, and the doubly-linked list
+ * is only restored in the final merge.
+ */
+static void list_sort(struct list_head *head)
 {
-    if (head == head->next)
-        return head;
+    struct list_head *list = head->next, *pending = NULL;
+    size_t count = 0;
 
-    struct list_head *fast = head;
-    struct list_head *mid = head->prev;
-    while (fast != mid && fast->next != mid) {
-        fast = fast->next;
-        mid = mid->prev;
+    /* Convert to a NULL-terminated singly-linked list */
+    head->prev->next = NULL;
+
+    do {
+        size_t bits;
+        struct list_head **tail = &pending;
+
+        /* Find the least-significant clear bit in count */
+        for (bits = count; bits & 1; bits >>= 1)
+            tail = &(*tail)->prev;
+        /* Do the indicated merge, unless count + 1 is a power of two */
+        if (bits) {
+            struct list_head *a = *tail, *b = a->prev;
+
+            a = merge(b, a);
+            a->prev = b->prev;
+            *tail = a;
+        }
+
+        /* Move one element from input list to pending */
+        list->prev = pending;
+        pending = list;
+        list = list->next;
+        pending->next = NULL;
+        count++;
+    } while (list);
+
+    /* End of input; merge together all the pending lists */
+    list = pending;
+    pending = pending->prev;
+    for (;;) {
+        struct list_head *next = pending->prev;
+
+        if (!next)
+            break;
+        list = merge(pending, list);
+        pending = next;
     }
 
-    struct list_head *left = head;
-    struct list_head *right = mid;
-    struct list_head *node = left->prev;
+    merge_final(head, pending, list);
+}
+
+/* A sorted run, kept as a NULL-terminated singly-linked list */
+typedef struct {
+    struct list_head *head, *tail;
+    size_t len;
+} run_t;
+
+/*
+ * Turn the NULL-terminated singly-linked list back into the circular
+ * doubly-linked list at head, restoring the prev pointers in one pass.
+ */
+static void relink(struct list_head *head, struct list_head *list)
+{
+    struct list_head *prev = head;
+    for (struct list_head *node = list; node; node = node->next) {
+        node->prev = prev;
+        prev->next = node;
+        prev = node;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
+
+/*
+ * Run lengths on the stack of natural_sort grow at least as fast as the
+ * Fibonacci numbers, so this is enough for any list that fits in memory.
+ */
+#define MAX_RUNS 96
+
+/* Number of consecutive wins of one side before a merge starts galloping */
+#define MIN_GALLOP 7
+
+/*
+ * Detach the run starting at list: either non-descending, or descending, in
+ * which case it is reversed in place. Equal elements met in a descending run
+ * are moved behind their equals rather than in front of them, which keeps
+ * the reversal stable.
+ * Return the element following the run.
+ */
+static struct list_head *find_run(struct list_head *list, run_t *run)
+{
+    struct list_head *cur = list, *next = list->next;
+    int r;
 
-    if (list_is_singular(left)) {
-        list_del_init(left);
-        list_del_init(right);
+    run->len = 1;
+    if (next && (r = ele_cmp(next, cur)) < 0) {
+        /* Last one of the equal elements at the front of the run */
+        struct list_head *group = list;
 
+        list->next = NULL;
+        run->tail = list;
+        do {
+            struct list_head *after = next->next;
+            if (r) {
+                next->next = cur;
+                cur = next;
+            } else {
+                next->next = group->next;
+                group->next = next;
+                if (run->tail == group)
+                    run->tail = next;
+            }
+            group = next;
+            next = after;
+            run->len++;
+        } while (next && (r = ele_cmp(next, cur)) <= 0);
+        run->head = cur;
     } else {
-        left->prev = right->prev;
-        left->prev->next = left;
-        node->next = right;
-        right->prev = node;
+        while (next && ele_cmp(next, cur) >= 0) {
+            cur = next;
+            next = next->next;
+            run->len++;
+        }
+        cur->next = NULL;
+        run->head = list;
+        run->tail = cur;
     }
-    return merge_list(sep_list(left), sep_list(right));
+    return next;
 }
 
-struct list_head *merge_list(struct list_head *left, struct list_head *right)
+/*
+ * Starting from node, which is known to win against key, find the last
+ * node of the stretch that still wins. A node wins when it compares below
+ * key, or equal to it unless strict is set. The stretch is probed at
+ * exponentially growing distances first and then bisected, so its length k
+ * costs O(log k) comparisons; only pointer chasing is linear.
+ * The length of the stretch is stored at *lenp.
+ */
+static struct list_head *gallop(struct list_head *node,
+                                const struct list_head *key,
+                                bool strict,
+                                size_t *lenp)
 {
-    struct list_head *head = NULL;
-    struct list_head *tmp = NULL;
+    struct list_head *last = node;
+    size_t len = 1, step = 1;
 
-    left->prev->next = NULL;
-    right->prev->next = NULL;
+    for (;;) {
+        struct list_head *probe = last;
+        size_t dist = 0;
+        while (dist < step && probe->next) {
+            probe = probe->next;
+            dist++;
+        }
+        if (!dist)
+            break;
 
-    while (left || right) {
-        if (!right ||
-            (left && strcmp(list_entry(left, element_t, list)->value,
-                            list_entry(right, element_t, list)->value) < 0)) {
-            if (!tmp) {
-                head = tmp = left;
-                left = left->next;
-                if (left)
-                    left->prev = tmp->prev;
-                INIT_LIST_HEAD(tmp);
+        int r = ele_cmp(probe, key);
+        if (strict ? r < 0 : r <= 0) {
+            last = probe;
+            len += dist;
+            step <<= 1;
+            continue;
+        }
+
+        /* The boundary lies within dist nodes past last */
+        while (dist > 1) {
+            size_t half = dist / 2;
+            struct list_head *mid = last;
+            for (size_t i = 0; i < half; i++)
+                mid = mid->next;
+            r = ele_cmp(mid, key);
+            if (strict ? r < 0 : r <= 0) {
+                last = mid;
+                len += half;
+                dist -= half;
             } else {
-                tmp = left;
-                left = left->next;
-                if (left)
-                    left->prev = tmp->prev;
-                list_add_tail(tmp, head);
+                dist = half;
             }
+        }
+        break;
+    }
+
+    *lenp = len;
+    return last;
+}
+
+/*
+ * Merge run b into run a, which precedes it, keeping the merge stable.
+ * Runs that are already in order, or entirely in reverse order, are
+ * concatenated in O(1). Once one side
+ * keeps winning, whole stretches are found by galloping and spliced at
+ * once, until the stretches become short again.
+ */
+static void merge_runs(run_t *a, const run_t *b)
+{
+    /* Not worth two extra comparisons for the short runs of random input */
+    bool check = a->len >= MIN_GALLOP && b->len >= MIN_GALLOP;
+
+    if (check && ele_cmp(a->tail, b->head) <= 0) {
+        a->tail->next = b->head;
+        a->tail = b->tail;
+        a->len += b->len;
+        return;
+    }
+    if (check && ele_cmp(b->tail, a->head) < 0) {
+        b->tail->next = a->head;
+        a->head = b->head;
+        a->len += b->len;
+        return;
+    }
+
+    struct list_head *head = NULL, **tail = &head;
+    struct list_head *x = a->head, *y = b->head;
+    size_t wins_a = 0, wins_b = 0, prev_len = 0;
+    bool galloping = false;
+
+    while (x && y) {
+        struct list_head *end;
+        size_t len = 1;
+
+        if (ele_cmp(x, y) <= 0) {
+            end = galloping ? gallop(x, y, false, &len) : x;
+            *tail = x;
+            x = end->next;
+            wins_a += len;
+            wins_b = 0;
         } else {
-            if (!tmp) {
-                head = tmp = right;
-                right = right->next;
-                if (right)
-                    right->prev = tmp->prev;
-                INIT_LIST_HEAD(tmp);
-            } else {
-                tmp = right;
-                right = right->next;
-                if (right)
-                    right->prev = tmp->prev;
-                list_add_tail(tmp, head);
+            end = galloping ? gallop(y, x, true, &len) : y;
+            *tail = y;
+            y = end->next;
+            wins_b += len;
+            wins_a = 0;
+        }
+        tail = &end->next;
+
+        if (galloping)
+            galloping = len >= MIN_GALLOP || prev_len >= MIN_GALLOP;
+        else
+            galloping = wins_a >= MIN_GALLOP || wins_b >= MIN_GALLOP;
+        prev_len = len;
+    }
+
+    if (x) {
+        *tail = x;
+    } else {
+        *tail = y;
+        a->tail = b->tail;
+    }
+    a->head = head;
+    a->len += b->len;
+}
+
+/* Merge runs[i] and runs[i + 1] of the n runs on the stack */
+static void merge_at(run_t *runs, int n, int i)
+{
+    merge_runs(&runs[i], &runs[i + 1]);
+    if (i + 2 < n)
+        runs[i + 1] = runs[i + 2];
+}
+
+/*
+ * Adaptive merge sort in the spirit of Timsort.
+ * The list is split into its natural runs, descending runs being flipped in
+ * place, and the runs are merged as they are pushed onto a stack whose
+ * lengths follow the Timsort invariants. Presorted or reversed input is
+ * sorted with about n comparisons.
+ */
+static void natural_sort(struct list_head *head)
+{
+    run_t runs[MAX_RUNS];
+    int n = 0;
+    struct list_head *list = head->next;
+
+    head->prev->next = NULL;
+    while (list) {
+        list = find_run(list, &runs[n++]);
+
+        while (n > 1) {
+            int i = n - 2;
+            if ((i > 0 && runs[i - 1].len <= runs[i].len + runs[i + 1].len) ||
+                (i > 1 &&
+                 runs[i - 2].len <= runs[i - 1].len + runs[i].len)) {
+                if (runs[i - 1].len < runs[i + 1].len)
+                    i--;
+            } else if (runs[i].len > runs[i + 1].len) {
+                break;
             }
+            merge_at(runs, n--, i);
         }
     }
-    return head;
+
+    while (n > 1) {
+        int i = n - 2;
+        if (i > 0 && runs[i - 1].len < runs[i + 1].len)
+            i--;
+        merge_at(runs, n--, i);
+    }
+
+    relink(head, runs[0].head);
+}
+
+/* Element of the array sorted by array_sort */
+typedef struct {
+    /* First 8 bytes of the string, big-endian, zero-padded */
+    uint64_t key;
+    element_t *ele;
+} sort_item_t;
+
+/* Runs of this many items are sorted by insertion before being merged */
+#define INSERTION_RUN 16
+
+static inline uint64_t key_prefix(const char *s)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < 8; i++) {
+        key <<= 8;
+        if (*s)
+            key |= (unsigned char) *s++;
+    }
+    return key;
+}
+
+/*
+ * Compare two items the way strcmp compares their strings. Most pairs are
+ * told apart by their prefixes; strcmp is only needed for the rest of two
+ * strings sharing their first 8 bytes.
+ */
+static inline int item_cmp(const sort_item_t *a, const sort_item_t *b)
+{
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+    /* A NUL within the prefix means the strings are equal */
+    if (!(a->key & 0xff))
+        return 0;
+    return strcmp(a->ele->value + 8, b->ele->value + 8);
+}
+
+/* Stable merge of the sorted ranges src[lo, mid) and src[mid, hi) into dst */
+static void merge_items(sort_item_t *dst,
+                        const sort_item_t *src,
+                        size_t lo,
+                        size_t mid,
+                        size_t hi)
+{
+    size_t i = lo, j = mid, k = lo;
+
+    while (i < mid && j < hi)
+        dst[k++] = item_cmp(&src[j], &src[i]) < 0 ? src[j++] : src[i++];
+    while (i < mid)
+        dst[k++] = src[i++];
+    while (j < hi)
+        dst[k++] = src[j++];
+}
+
+/*
+ * Sort a contiguous array of n items, using tmp as scratch space of the
+ * same size. Return the array holding the result, either items or tmp.
+ */
+static sort_item_t *sort_items(sort_item_t *items, sort_item_t *tmp, size_t n)
+{
+    for (size_t lo = 0; lo < n; lo += INSERTION_RUN) {
+        size_t hi = lo + INSERTION_RUN < n ? lo + INSERTION_RUN : n;
+        for (size_t i = lo + 1; i < hi; i++) {
+            sort_item_t item = items[i];
+            size_t j = i;
+            for (; j > lo && item_cmp(&item, &items[j - 1]) < 0; j--)
+                items[j] = items[j - 1];
+            items[j] = item;
+        }
+    }
+
+    sort_item_t *src = items, *dst = tmp;
+    for (size_t width = INSERTION_RUN; width < n; width <<= 1) {
+        for (size_t lo = 0; lo < n; lo += 2 * width) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+            merge_items(dst, src, lo, mid, hi);
+        }
+        sort_item_t *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    return src;
+}
+
+/*
+ * Gather the elements into a contiguous array along with their key
+ * prefixes, sort the array, and scatter the order back to the list in a
+ * single pass. Sorting the array is much kinder to the caches than chasing
+ * list pointers, and most comparisons never touch the strings.
+ * Return false if the array could not be allocated.
+ */
+static bool array_sort(struct list_head *head)
+{
+    size_t n = to_queue(head)->size;
+    sort_item_t *items = malloc(2 * n * sizeof(sort_item_t));
+    if (!items)
+        return false;
+
+    size_t i = 0;
+    struct list_head *node;
+    list_for_each (node, head) {
+        element_t *e = list_entry(node, element_t, list);
+        items[i].key = key_prefix(e->value);
+        items[i++].ele = e;
+    }
+
+    sort_item_t *sorted = sort_items(items, items + n, n);
+
+    struct list_head *prev = head;
+    for (i = 0; i < n; i++) {
+        node = &sorted[i].ele->list;
+        node->prev = prev;
+        prev->next = node;
+        prev = node;
+    }
+    prev->next = head;
+    head->prev = prev;
+
+    free(items);
+    return true;
+}
+
+/* Buckets with fewer elements are left to a comparison sort */
+#define RADIX_CUTOFF 32
+
+/*
+ * Maximum number of nested bucket levels. Each one takes a few kilobytes of
+ * stack; deeper buckets are left to a comparison sort as well.
+ */
+#define RADIX_MAX_LEVEL 64
+
+/* Comparison sort of a run, going through a temporary list head */
+static void chain_sort(run_t *run)
+{
+    if (run->len < 2)
+        return;
+
+    struct list_head tmp = {.next = run->head, .prev = run->tail};
+    run->tail->next = &tmp;
+    list_sort(&tmp);
+    run->head = tmp.next;
+    run->tail = tmp.prev;
+    run->tail->next = NULL;
+}
+
+/*
+ * Most-significant-digit radix sort of a run whose strings all share their
+ * first depth bytes. Elements are distributed into 256 buckets by the byte
+ * at depth, each bucket is sorted by the following bytes, and the buckets
+ * are concatenated. Strings that end at depth are all equal, so their bucket
+ * is already in order. Distribution keeps the original order of every
+ * bucket, which makes the sort stable.
+ */
+static void radix_sort(run_t *run, size_t depth, int level)
+{
+    for (;;) {
+        if (run->len < RADIX_CUTOFF || level == RADIX_MAX_LEVEL) {
+            chain_sort(run);
+            return;
+        }
+
+        run_t bucket[256] = {{0}};
+        for (struct list_head *node = run->head; node; node = node->next) {
+            unsigned char c = list_entry(node, element_t, list)->value[depth];
+            run_t *b = &bucket[c];
+            if (b->len)
+                b->tail->next = node;
+            else
+                b->head = node;
+            b->tail = node;
+            b->len++;
+        }
+
+        /* A common byte leaves the run as it was; just look further */
+        unsigned char c = list_entry(run->head, element_t, list)->value[depth];
+        if (bucket[c].len == run->len) {
+            if (!c)
+                return;
+            depth++;
+            continue;
+        }
+
+        struct list_head **tail = &run->head;
+        for (int i = 0; i < 256; i++) {
+            run_t *b = &bucket[i];
+            if (!b->len)
+                continue;
+            b->tail->next = NULL;
+            if (i)
+                radix_sort(b, depth + 1, level + 1);
+            *tail = b->head;
+            tail = &b->tail->next;
+            run->tail = b->tail;
+        }
+        return;
+    }
+}
+
+/* Sort a queue of at least two elements with the selected algorithm */
+static void sort_list(struct list_head *head)
+{
+    switch (q_sort_algo) {
+    case Q_SORT_NATURAL:
+        natural_sort(head);
+        break;
+    case Q_SORT_ARRAY:
+        /* Fall back to list sorting when the array cannot be allocated */
+        if (!array_sort(head))
+            list_sort(head);
+        break;
+    case Q_SORT_RADIX: {
+        run_t run = {head->next, head->prev, to_queue(head)->size};
+        head->prev->next = NULL;
+        radix_sort(&run, 0, 0);
+        relink(head, run.head);
+        break;
+    }
+    default:
+        list_sort(head);
+        break;
+    }
+}
+
+/* Upper bound of q_sort_threads */
+#define MAX_SORT_THREADS 64
+
+/* Do not hand out parts smaller than this to separate threads */
+#define MIN_PART_SIZE 1024
+
+/* Part of the queue handled by one thread of parallel_sort */
+typedef struct {
+    /* Only the head and the size are used, which is all sort_list needs */
+    queue_t q;
+    /* Sorted parts to be merged, as NULL-terminated lists */
+    struct list_head *list, *other;
+    pthread_t thread;
+} sort_part_t;
+
+static void *sort_worker(void *arg)
+{
+    sort_part_t *part = arg;
+    sort_list(&part->q.head);
+    return NULL;
+}
+
+static void *merge_worker(void *arg)
+{
+    sort_part_t *part = arg;
+    part->list = merge(part->list, part->other);
+    return NULL;
+}
+
+/*
+ * Run fn on each of the n jobs concurrently. The calling thread takes the
+ * first job itself, as well as any job whose thread could not be created.
+ * Workers start with asynchronous signals blocked, so that the time limit
+ * of the harness always fires on the calling thread, which owns the
+ * exception context. Faults stay unblocked, so that a crash in a worker
+ * still goes through the handler of the program.
+ */
+static void run_workers(void *(*fn)(void *), sort_part_t **jobs, int n)
+{
+    bool started[MAX_SORT_THREADS] = {false};
+    sigset_t all, old;
+
+    sigfillset(&all);
+    sigdelset(&all, SIGSEGV);
+    sigdelset(&all, SIGBUS);
+    sigdelset(&all, SIGFPE);
+    sigdelset(&all, SIGILL);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 1; i < n; i++)
+        started[i] = !pthread_create(&jobs[i]->thread, NULL, fn, jobs[i]);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    fn(jobs[0]);
+    for (int i = 1; i < n; i++) {
+        if (started[i])
+            pthread_join(jobs[i]->thread, NULL);
+        else
+            fn(jobs[i]);
+    }
+}
+
+/*
+ * Cut the queue into one part per thread, sort the parts concurrently, and
+ * merge them pairwise in parallel rounds. Parts keep the order of the
+ * queue and earlier parts win ties, so the result is as stable as the
+ * selected algorithm. The last merge rebuilds the list at head.
+ *
+ * The parts live in this frame and are linked into the queue until the
+ * end, so the time limit is held back until the queue is whole again and
+ * every worker has been joined. Leaving early through the exception
+ * context would let the workers write into a dead frame.
+ */
+static void parallel_sort(struct list_head *head, int threads)
+{
+    size_t n = to_queue(head)->size;
+    sort_part_t parts[MAX_SORT_THREADS];
+    sort_part_t *jobs[MAX_SORT_THREADS];
+    sigset_t alarm, old;
+
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm, &old);
+
+    struct list_head *node = head->next;
+    for (int i = 0; i < threads; i++) {
+        queue_t *q = &parts[i].q;
+        q->size = n / threads + ((size_t) i < n % threads);
+        q->head.next = node;
+        node->prev = &q->head;
+        for (size_t j = 1; j < q->size; j++)
+            node = node->next;
+        q->head.prev = node;
+        struct list_head *next = node->next;
+        node->next = &q->head;
+        node = next;
+        jobs[i] = &parts[i];
+    }
+    run_workers(sort_worker, jobs, threads);
+
+    for (int i = 0; i < threads; i++) {
+        parts[i].list = parts[i].q.head.next;
+        parts[i].q.head.prev->next = NULL;
+    }
+
+    int stride = 1;
+    for (; 2 * stride < threads; stride <<= 1) {
+        int cnt = 0;
+        for (int i = 0; i + stride < threads; i += 2 * stride) {
+            parts[i].other = parts[i + stride].list;
+            jobs[cnt++] = &parts[i];
+        }
+        run_workers(merge_worker, jobs, cnt);
+    }
+    merge_final(head, parts[0].list, parts[stride].list);
+
+    /* A pending time limit fires here */
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Sort elements of queue in ascending order
+ * No effect if q is NULL or empty. In addition, if q has only one
+ * element, do nothing.
+ */
+void q_sort(struct list_head *head)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
+
+    size_t parts = to_queue(head)->size / MIN_PART_SIZE;
+    int threads = q_sort_threads <= 1                  ? 1
+                  : q_sort_threads < MAX_SORT_THREADS ? q_sort_threads
+                                                      : MAX_SORT_THREADS;
+    if ((size_t) threads > parts)
+        threads = parts;
+
+    if (threads > 1)
+        parallel_sort(head, threads);
+    else
+        sort_list(head);
+}
+
+/* State of the xoshiro256** generator used by q_shuffle */
+static uint64_t rng_state[4];
+static bool rng_seeded = false;
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/*
+ * Seed the random number generator used by q_shuffle.
+ * The state is expanded from the seed with splitmix64, as recommended by
+ * the authors of xoshiro.
+ */
+void q_shuffle_seed(uint64_t seed)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        rng_state[i] = z ^ (z >> 31);
+    }
+    rng_seeded = true;
+}
+
+/* Next output of xoshiro256** */
+static uint64_t rng_next(void)
+{
+    uint64_t *s = rng_state;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+/*
+ * Return a number uniformly distributed in [0, n), using Lemire's
+ * multiply-and-reject method, which avoids both the bias of a plain modulo
+ * and a division in the common case.
+ */
+static uint64_t rng_below(uint64_t n)
+{
+    __uint128_t m = (__uint128_t) rng_next() * n;
+    uint64_t low = (uint64_t) m;
+
+    if (low < n) {
+        uint64_t threshold = -n % n;
+        while (low < threshold) {
+            m = (__uint128_t) rng_next() * n;
+            low = (uint64_t) m;
+        }
+    }
+    return m >> 64;
+}
+
+/*
+ * Shuffle elements of queue uniformly at random with the Fisher-Yates
+ * algorithm, in O(n) time.
+ * The nodes are gathered into an array, shuffled there, and relinked in a
+ * single pass.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space.
+ */
+bool q_shuffle(struct list_head *head)
+{
+    if (!head)
+        return false;
+    if (list_empty(head) || list_is_singular(head))
+        return true;
+
+    size_t n = to_queue(head)->size;
+    struct list_head **nodes = malloc(n * sizeof(struct list_head *));
+    if (!nodes)
+        return false;
+
+    if (!rng_seeded)
+        q_shuffle_seed(time(NULL));
+
+    size_t i = 0;
+    struct list_head *node;
+    list_for_each (node, head)
+        nodes[i++] = node;
+
+    for (i = n - 1; i > 0; i--) {
+        size_t j = rng_below(i + 1);
+        struct list_head *tmp = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = tmp;
+    }
+
+    struct list_head *prev = head;
+    for (i = 0; i < n; i++) {
+        nodes[i]->prev = prev;
+        prev->next = nodes[i];
+        prev = nodes[i];
+    }
+    prev->next = head;
+    head->prev = prev;
+
+    free(nodes);
+    return true;
 }
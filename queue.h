@@ -10,6 +10,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include "list.h"
 
 /* Linked list element */
@@ -21,6 +22,44 @@ typedef struct {
     struct list_head list;
 } element_t;
 
+/*
+ * Memory layout of the elements created by q_insert_head and q_insert_tail.
+ * Q_LAYOUT_SPLIT: element and string are allocated separately.
+ * Q_LAYOUT_INLINE: the string is stored at the end of the element, which
+ *                  takes a single allocation per element.
+ * Q_LAYOUT_ARENA: like Q_LAYOUT_INLINE, but elements are carved out of large
+ *                 slabs owned by the queue. Releasing such an element is a
+ *                 no-op; its memory comes back when the queue is freed, so
+ *                 removed elements must not outlive their queue.
+ * The layout is picked up by q_new. q_release_element accepts elements of
+ * any layout.
+ */
+enum { Q_LAYOUT_SPLIT, Q_LAYOUT_INLINE, Q_LAYOUT_ARENA };
+extern int q_layout;
+
+/*
+ * Algorithm used by q_sort.
+ * Q_SORT_MERGE: bottom-up merge sort, as done by Linux's list_sort.
+ * Q_SORT_NATURAL: adaptive merge of the runs already present in the queue,
+ *                 which sorts presorted and reversed queues in linear time.
+ * Q_SORT_ARRAY: sort an array of element pointers and 8-byte key prefixes,
+ *               then relink the list. This is the only algorithm that
+ *               allocates memory; it falls back to Q_SORT_MERGE when the
+ *               array cannot be allocated.
+ * Q_SORT_RADIX: most-significant-digit radix sort on the bytes of the
+ *               strings, falling back to merge sort for small buckets.
+ */
+enum { Q_SORT_MERGE, Q_SORT_NATURAL, Q_SORT_ARRAY, Q_SORT_RADIX };
+extern int q_sort_algo;
+
+/*
+ * Number of threads used by q_sort. With more than one, the queue is cut
+ * into that many parts, which are sorted concurrently with q_sort_algo and
+ * then merged pairwise in parallel. Small queues are sorted by the calling
+ * thread alone.
+ */
+extern int q_sort_threads;
+
 /* Operations on queue */
 
 /*
@@ -32,6 +71,7 @@ struct list_head *q_new();
 /*
  * Free ALL storage used by queue.
  * No effect if q is NULL
+ * The elements of an arena queue are released in O(number of slabs).
  */
 void q_free(struct list_head *head);
 
@@ -53,12 +93,41 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/*
+ * Attempt to insert n elements at head of queue, as if q_insert_head were
+ * called on s[0], ..., s[n - 1] in turn.
+ * If lens is non-NULL, lens[i] gives the number of characters to copy from
+ * s[i]; otherwise the strings must be null-terminated.
+ * All elements and strings are allocated as one block and spliced into the
+ * queue at once. Either all of them are inserted, or none.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space.
+ */
+bool q_insert_head_bulk(struct list_head *head,
+                        char **s,
+                        const size_t *lens,
+                        size_t n);
+
+/*
+ * Attempt to insert n elements at tail of queue, as if q_insert_tail were
+ * called on s[0], ..., s[n - 1] in turn.
+ * Other attribute is as same as q_insert_head_bulk.
+ */
+bool q_insert_tail_bulk(struct list_head *head,
+                        char **s,
+                        const size_t *lens,
+                        size_t n);
+
 /*
  * Attempt to remove element from head of queue.
  * Return target element.
  * Return NULL if queue is NULL or empty.
  * If sp is non-NULL and an element is removed, copy the removed string to *sp
  * (up to a maximum of bufsize-1 characters, plus a null terminator.)
+ * Only the string itself is copied, not the rest of the buffer.
+ * If sp is NULL, nothing is copied at all: the string stays owned by the
+ * returned element and can be read through its value field until the element
+ * is passed to q_release_element.
  *
  * NOTE: "remove" is different from "delete"
  * The space used by the list element and the string should not be freed.
@@ -75,6 +144,25 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/*
+ * Attempt to remove the first k elements of queue at once.
+ * Return the number of elements removed, which is less than k if the queue
+ * holds fewer than k elements, or 0 if q is NULL or empty.
+ * Argument list points to a list head that receives the removed elements in
+ * queue order; whatever it held before is overwritten.
+ *
+ * No string is copied: the caller owns the detached elements and releases
+ * them with q_release_element. The removed nodes are found by walking the
+ * queue, then cut out with list_cut_position.
+ */
+int q_remove_head_n(struct list_head *head, struct list_head *list, int k);
+
+/*
+ * Attempt to remove the last k elements of queue at once.
+ * Other attribute is as same as q_remove_head_n.
+ */
+int q_remove_tail_n(struct list_head *head, struct list_head *list, int k);
+
 /*
  * Attempt to release element.
  */
@@ -83,6 +171,7 @@ void q_release_element(element_t *e);
 /*
  * Return number of elements in queue.
  * Return 0 if q is NULL or empty
+ * Runs in O(1), since every operation keeps the count of the queue current.
  */
 int q_size(struct list_head *head);
 
@@ -127,7 +216,24 @@ void q_reverse(struct list_head *head);
  * Sort elements of queue in ascending order
  * No effect if q is NULL or empty. In addition, if q has only one
  * element, do nothing.
+ * The sort is stable. It does not allocate memory unless q_sort_algo is
+ * Q_SORT_ARRAY.
  */
 void q_sort(struct list_head *head);
 
+/*
+ * Shuffle elements of queue uniformly at random with the Fisher-Yates
+ * algorithm, in O(n) time.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space.
+ */
+bool q_shuffle(struct list_head *head);
+
+/*
+ * Seed the random number generator used by q_shuffle, which makes the
+ * following shuffles reproducible. Without a seed, the generator is seeded
+ * from the current time on first use.
+ */
+void q_shuffle_seed(uint64_t seed);
+
 #endif /* LAB0_QUEUE_H */
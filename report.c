@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -6,16 +8,23 @@
 #include <string.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "report.h"
 
+/* Only to hold back exceptions while the log lock is taken */
+#define INTERNAL 1
+#include "harness.h"
+
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
+static FILE *metricsfile = NULL;
 
 int verblevel = 0;
 static void init_files(FILE *efile, FILE *vfile)
@@ -44,12 +53,322 @@ void set_verblevel(int level)
     verblevel = level;
 }
 
+/*
+ * Asynchronous logging.  When enabled, report() and report_noreturn() format
+ * into a per-thread buffer and append the text to one ring per destination.
+ * A writer thread drains the rings with writev, so whatever accumulated since
+ * its last pass goes out in a single system call.  Errors are still written
+ * synchronously, once the rings have been drained, to keep the output in
+ * order.
+ */
+#define LOG_RING_SIZE (1 << 18)
+#define LOG_LINE_MAX 4096
+/* Fill level of a ring at which the writer stops waiting for more text */
+#define LOG_HIGH_WATER (LOG_RING_SIZE / 2)
+/* How long the writer lets text pile up before writing it out */
+#define LOG_LINGER_NS 10000000L
+
+typedef struct {
+    int fd; /* -1 when there is no such destination */
+    char *buf;
+    size_t head; /* Bytes ever appended */
+    size_t tail; /* Bytes ever written out */
+} log_ring_t;
+
+enum { RING_VERB, RING_LOG, RING_CNT };
+
+static char ring_bufs[RING_CNT][LOG_RING_SIZE];
+static log_ring_t rings[RING_CNT];
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signaled when text is appended or the writer must stop */
+static pthread_cond_t log_ready = PTHREAD_COND_INITIALIZER;
+/* Signaled when the writer has written some text out */
+static pthread_cond_t log_drained = PTHREAD_COND_INITIALIZER;
+static pthread_t log_thread;
+static bool log_async = false;
+static bool log_stop = false;
+/* Set when text must be written out without lingering */
+static bool log_urgent = false;
+
+static __thread char line_buf[LOG_LINE_MAX];
+/* Set while this thread holds log_lock */
+static __thread bool holding_log_lock = false;
+
+static bool log_pending()
+{
+    for (int i = 0; i < RING_CNT; i++) {
+        if (rings[i].head != rings[i].tail)
+            return true;
+    }
+    return false;
+}
+
+static void write_all(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (cnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void *log_writer(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&log_lock);
+    while (true) {
+        while (!log_pending() && !log_stop)
+            pthread_cond_wait(&log_ready, &log_lock);
+        if (!log_pending())
+            break;
+
+        /* Let the text pile up, so that it goes out in few system calls */
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_LINGER_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!log_urgent && !log_stop &&
+               pthread_cond_timedwait(&log_ready, &log_lock, &deadline) !=
+                   ETIMEDOUT)
+            ;
+        log_urgent = false;
+
+        /* Text in [tail, head) stays put until tail moves past it */
+        int fd[RING_CNT];
+        size_t end[RING_CNT];
+        for (int i = 0; i < RING_CNT; i++) {
+            fd[i] = rings[i].fd;
+            end[i] = rings[i].head;
+        }
+        pthread_mutex_unlock(&log_lock);
+
+        for (int i = 0; i < RING_CNT; i++) {
+            log_ring_t *r = &rings[i];
+            size_t len = end[i] - r->tail;
+            if (len == 0 || fd[i] < 0)
+                continue;
+            size_t start = r->tail % LOG_RING_SIZE;
+            size_t first = MIN(len, LOG_RING_SIZE - start);
+            struct iovec iov[2] = {
+                {.iov_base = r->buf + start, .iov_len = first},
+                {.iov_base = r->buf, .iov_len = len - first},
+            };
+            write_all(fd[i], iov, len > first ? 2 : 1);
+        }
+
+        pthread_mutex_lock(&log_lock);
+        for (int i = 0; i < RING_CNT; i++)
+            rings[i].tail = end[i];
+        pthread_cond_broadcast(&log_drained);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+/*
+ * Take log_lock with exceptions held back, so that the time limit cannot
+ * jump out of a section holding it. A fault handler reporting on this
+ * thread finds holding_log_lock set and writes directly instead.
+ */
+static void log_lock_acquire()
+{
+    exception_hold();
+    pthread_mutex_lock(&log_lock);
+    holding_log_lock = true;
+}
+
+static void log_lock_release()
+{
+    holding_log_lock = false;
+    pthread_mutex_unlock(&log_lock);
+    exception_release();
+}
+
+/*
+ * Append len bytes at s to ring r, which must have a destination. Return
+ * whether the writer needs waking: it sleeps once every ring is empty, and
+ * stops lingering once a ring is half full.
+ */
+static bool log_append(log_ring_t *r, const char *s, size_t len)
+{
+    while (LOG_RING_SIZE - (r->head - r->tail) < len)
+        pthread_cond_wait(&log_drained, &log_lock);
+
+    size_t used = r->head - r->tail;
+    size_t start = r->head % LOG_RING_SIZE;
+    size_t first = MIN(len, LOG_RING_SIZE - start);
+    memcpy(r->buf + start, s, first);
+    memcpy(r->buf, s + first, len - first);
+    r->head += len;
+    if (used < LOG_HIGH_WATER && used + len >= LOG_HIGH_WATER) {
+        log_urgent = true;
+        return true;
+    }
+    return !used;
+}
+
+/* Queue a message for the writer thread.  Return false if it is too long */
+static bool log_vqueue(const char *fmt, va_list ap, bool newline)
+{
+    int n = vsnprintf(line_buf, sizeof(line_buf) - 1, fmt, ap);
+    if (n < 0 || (size_t) n >= sizeof(line_buf) - 1)
+        return false;
+    if (newline)
+        line_buf[n++] = '\n';
+
+    bool wake = false;
+    log_lock_acquire();
+    for (int i = 0; i < RING_CNT; i++) {
+        if (rings[i].fd >= 0 && log_append(&rings[i], line_buf, n))
+            wake = true;
+    }
+    if (wake)
+        pthread_cond_signal(&log_ready);
+    log_lock_release();
+    return true;
+}
+
+void report_flush()
+{
+    /* Waiting while holding the lock, e.g., in a fault handler, never ends */
+    if (!log_async || holding_log_lock)
+        return;
+    log_lock_acquire();
+    log_urgent = true;
+    pthread_cond_signal(&log_ready);
+    while (log_pending())
+        pthread_cond_wait(&log_drained, &log_lock);
+    log_lock_release();
+}
+
+/* Point the log ring at the current log file */
+static void update_log_fd()
+{
+    int fd = logfile ? fileno(logfile) : -1;
+    if (!log_async || holding_log_lock) {
+        rings[RING_LOG].fd = fd;
+        return;
+    }
+    log_lock_acquire();
+    rings[RING_LOG].fd = fd;
+    log_lock_release();
+}
+
+bool set_async_log(bool enable)
+{
+    if (enable == log_async)
+        return true;
+
+    if (!enable) {
+        report_flush();
+        log_lock_acquire();
+        log_stop = true;
+        pthread_cond_signal(&log_ready);
+        log_lock_release();
+        pthread_join(log_thread, NULL);
+        log_async = false;
+        return true;
+    }
+
+    if (!verbfile)
+        init_files(stdout, stdout);
+    fflush(verbfile);
+    if (logfile)
+        fflush(logfile);
+    for (int i = 0; i < RING_CNT; i++) {
+        rings[i].buf = ring_bufs[i];
+        rings[i].head = rings[i].tail = 0;
+    }
+    rings[RING_VERB].fd = fileno(verbfile);
+    rings[RING_LOG].fd = logfile ? fileno(logfile) : -1;
+    log_stop = false;
+
+    /* Signals such as the time limit must go to the thread running commands */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&log_thread, NULL, log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        report_event(MSG_WARN, "Cannot start log writer: %s", strerror(err));
+        return false;
+    }
+
+    static bool exit_flush_set = false;
+    if (!exit_flush_set) {
+        atexit(report_flush);
+        exit_flush_set = true;
+    }
+    log_async = true;
+    return true;
+}
+
 bool set_logfile(char *file_name)
 {
+    report_flush();
     logfile = fopen(file_name, "w");
+    update_log_fd();
     return logfile != NULL;
 }
 
+bool set_metricsfile(char *file_name)
+{
+    metricsfile = fopen(file_name, "w");
+    return metricsfile != NULL;
+}
+
+/* Write s as a JSON string */
+static void json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+void report_metrics(const cmd_metrics_t *m)
+{
+    if (!metricsfile || m->argc < 1)
+        return;
+
+    fprintf(metricsfile, "{\"cmd\":");
+    json_string(metricsfile, m->argv[0]);
+    fprintf(metricsfile, ",\"args\":[");
+    for (int i = 1; i < m->argc; i++) {
+        if (i > 1)
+            fputc(',', metricsfile);
+        json_string(metricsfile, m->argv[i]);
+    }
+    fprintf(metricsfile,
+            "],\"duration_ns\":%lu,\"allocations\":%lu,\"bytes\":%lu,"
+            "\"peak_bytes\":%lu,\"result\":%s}\n",
+            (unsigned long) m->duration_ns, m->allocs, m->bytes, m->peak_bytes,
+            m->ok ? "true" : "false");
+    fflush(metricsfile);
+}
+
 void report_event(message_t msg, char *fmt, ...)
 {
     va_list ap;
@@ -64,6 +383,8 @@ void report_event(message_t msg, char *fmt, ...)
     if (!errfile)
         init_files(stdout, stdout);
 
+    report_flush();
+
     va_start(ap, fmt);
     fprintf(errfile, "%s: ", msg_name);
     vfprintf(errfile, fmt, ap);
@@ -79,6 +400,8 @@ void report_event(message_t msg, char *fmt, ...)
         fflush(logfile);
         va_end(ap);
         fclose(logfile);
+        logfile = NULL;
+        update_log_fd();
     }
 
     if (fatal) {
@@ -95,6 +418,15 @@ void report(int level, char *fmt, ...)
 
     if (level <= verblevel) {
         va_list ap;
+        if (log_async && !holding_log_lock) {
+            va_start(ap, fmt);
+            bool queued = log_vqueue(fmt, ap, true);
+            va_end(ap);
+            if (queued)
+                return;
+            report_flush();
+        }
+
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
         fprintf(verbfile, "\n");
@@ -118,6 +450,15 @@ void report_noreturn(int level, char *fmt, ...)
 
     if (level <= verblevel) {
         va_list ap;
+        if (log_async && !holding_log_lock) {
+            va_start(ap, fmt);
+            bool queued = log_vqueue(fmt, ap, false);
+            va_end(ap);
+            if (queued)
+                return;
+            report_flush();
+        }
+
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
         fflush(verbfile);
@@ -137,6 +478,7 @@ void report_noreturn(int level, char *fmt, ...)
 /* Need to be able to print without using malloc */
 static void fail_fun(char *format, char *msg)
 {
+    report_flush();
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
@@ -240,6 +582,12 @@ char *strsave_or_fail(char *s, char *fun_name)
     return strncpy(ss, s, len + 1);
 }
 
+void memory_usage(size_t *current, size_t *peak)
+{
+    *current = current_bytes;
+    *peak = peak_bytes;
+}
+
 /* Free block, as from malloc, realloc, or strsave */
 void free_block(void *b, size_t bytes)
 {
@@ -3,6 +3,8 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* Default reporting level.  Must recompile when change */
 #ifndef RPT
@@ -19,6 +21,25 @@ typedef enum { MSG_WARN, MSG_ERROR, MSG_FATAL } message_t;
 
 bool set_logfile(char *file_name);
 
+/*
+ * Machine-readable metrics, one JSON object per line, kept apart from the
+ * text reports.
+ */
+typedef struct {
+    int argc;
+    char **argv; /* Command name and its arguments */
+    uint64_t duration_ns;
+    size_t allocs;
+    size_t bytes;
+    size_t peak_bytes;
+    bool ok;
+} cmd_metrics_t;
+
+bool set_metricsfile(char *file_name);
+
+/* Emit the metrics of one command, if a metrics file is set */
+void report_metrics(const cmd_metrics_t *m);
+
 extern int verblevel;
 void set_verblevel(int level);
 
@@ -31,6 +52,15 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/*
+ * Hand reports to a background writer thread instead of writing them out
+ * directly.  Returns false if the writer cannot be started.
+ */
+bool set_async_log(bool enable);
+
+/* Wait until every queued report has been written out */
+void report_flush();
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, char *fun_name);
 
@@ -40,6 +70,9 @@ void *calloc_or_fail(size_t cnt, size_t bytes, char *fun_name);
 /* Attempt to save string.  Fail when malloc returns NULL */
 char *strsave_or_fail(char *s, char *fun_name);
 
+/* Bytes currently and at most allocated through the functions above */
+void memory_usage(size_t *current, size_t *peak);
+
 /* Free block, as from malloc, or strsave */
 void free_block(void *b, size_t len);
 
@@ -0,0 +1,64 @@
+# Test every sorting algorithm, single- and multi-threaded, on large queues
+option fail 0
+option malloc 0
+new
+ih RAND 100000
+it gerbil 20000
+option threads 1
+option sort 0
+sort
+reverse
+sort
+shuffle
+option sort 1
+sort
+reverse
+sort
+shuffle
+option sort 2
+sort
+reverse
+sort
+shuffle
+option sort 3
+sort
+reverse
+sort
+shuffle
+option threads 4
+option sort 0
+sort
+reverse
+sort
+shuffle
+option sort 1
+sort
+reverse
+sort
+shuffle
+option sort 2
+sort
+reverse
+sort
+shuffle
+option sort 3
+sort
+reverse
+sort
+shuffle
+option threads 1000
+sort
+free
+option layout 1
+new
+ih RAND 100000
+option threads 8
+option sort 2
+sort
+free
+option layout 2
+new
+ih RAND 100000
+option sort 3
+sort
+free
@@ -0,0 +1,69 @@
+# Test of bulk removal and bulk insertion in every element layout
+option fail 100
+option malloc 0
+rhn 2
+rtn 2
+new
+rhn 3
+rtn 3
+ih dolphin 3
+it bear 4
+ih gerbil
+rhn 2
+rh dolphin
+rtn 2
+rt bear
+rhn 10
+rtn 1
+it meerkat 5
+rtn 5
+free
+option layout 1
+new
+ih dolphin 50
+it bear 50
+rhn 49
+rh dolphin
+rh bear
+rtn 48
+rt bear
+free
+option layout 2
+new
+ih dolphin 50
+it RAND 1000
+ih gerbil 20
+rtn 1000
+rt dolphin
+rhn 20
+rh dolphin
+free
+option layout 0
+new
+option malloc 50
+ih gerbil 30
+it meerkat 30
+ih RAND 30
+it RAND 30
+rhn 5
+rtn 5
+option malloc 0
+free
+option layout 1
+new
+option malloc 50
+ih dolphin 30
+it bear 30
+ih dolphin 30
+it bear 30
+option malloc 0
+free
+option layout 2
+new
+option malloc 50
+ih gerbil 30
+it meerkat 30
+ih gerbil 30
+it meerkat 30
+option malloc 0
+free
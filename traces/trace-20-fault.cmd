@@ -0,0 +1,51 @@
+# Test of deterministic allocation fault injection
+option fail 100
+option malloc 0
+new
+# Allocations 1 and 2 hold a, the 3rd one is the element of b
+option fail_nth 3
+ih a
+ih b
+ih c
+rh c
+rh a
+option fail_nth 0
+free
+# One allocation per element, so every other insertion fails
+option layout 1
+new
+option fail_every 2
+ih a
+ih b
+ih c
+ih d
+rh c
+rh a
+option fail_every 0
+free
+# Strings of 63 to 127 bytes fall in the size class of 100
+option layout 0
+new
+option fail_size 100
+ih kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk
+ih mmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmm
+ih nnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnnn
+ih ppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppp
+rh ppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppppp
+rh kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk
+option fail_size 0
+# The same seed fails the same allocations on every run
+option fail_seed 7
+option malloc 50
+ih dolphin
+ih bear
+ih gerbil
+ih meerkat
+ih vulture
+ih squirrel
+ih gecko
+ih jaguar
+option malloc 0
+option fail_seed 0
+rh gerbil
+free
@@ -0,0 +1,44 @@
+# Test of queue operations with every block between guard pages
+option fail 0
+option malloc 0
+option guard 1
+new
+ih dolphin
+ih bear
+it gerbil
+rh bear
+rt gerbil
+ih RAND 500
+it RAND 500
+option sort 2
+sort
+reverse
+option sort 0
+sort
+dm
+swap
+rhn 100
+rtn 100
+free
+option layout 1
+new
+ih meerkat 300
+it RAND 300
+shuffle
+sort
+rhn 300
+free
+option layout 2
+new
+it vulture 200
+ih RAND 200
+rhn 200
+rh vulture
+sort
+free
+option layout 0
+option guard 0
+new
+ih gecko
+rh gecko
+free
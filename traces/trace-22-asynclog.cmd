@@ -0,0 +1,33 @@
+# Test of queue operations with reports written by a background thread
+option fail 30
+option malloc 0
+option asynclog 1
+new
+ih dolphin
+ih bear
+it gerbil
+rh bear
+rt gerbil
+it RAND 2000
+show
+reverse
+sort
+rhn 1000
+rtn 999
+rh
+option malloc 25
+ih meerkat 20
+it vulture 20
+ih squirrel
+ih squirrel
+ih squirrel
+option malloc 0
+option asynclog 0
+show
+option asynclog 1
+free
+new
+it gecko 5
+rh gecko
+rtn 4
+free